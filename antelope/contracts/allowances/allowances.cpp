@@ -1,13 +1,73 @@
 #include <eosio/asset.hpp>
+#include <eosio/crypto.hpp>
 #include <eosio/eosio.hpp>
+#include <eosio/permission.hpp>
+#include <eosio/system.hpp>
 
 #include "../library/totems.hpp"
+#include "../library/open_quota.hpp"
 using namespace eosio;
 
 CONTRACT allowances : public contract {
    public:
     using contract::contract;
 
+    // Everything an owner has approved a spender for, scoped by owner.
+    // Looking up (owner, spender) is a primary key find, without a secondary index to maintain.
+    struct [[eosio::table]] Approval {
+		name spender;
+		std::vector<asset> allowances; // one per totem
+
+		uint64_t primary_key() const { return spender.value; }
+	};
+
+    struct Payment {
+		name recipient;
+		asset quantity;
+		std::string memo;
+	};
+
+    // An allowance signed off-chain by the owner, so it doesn't need its own `approve` transaction
+    struct Permit {
+		name owner;
+		name spender;
+		asset allowance;
+		uint64_t nonce;
+		time_point_sec deadline;
+		signature sig;
+	};
+
+    // The next permit nonce for each owner, so a permit can only be used once
+    struct [[eosio::table]] Nonce {
+		name owner;
+		uint64_t next;
+
+		uint64_t primary_key() const { return owner.value; }
+	};
+
+    // Reverse lookup of `approvals`, scoped by spender, one row per owner and totem.
+    // Keyed by (ticker, owner), so listing one totem's owners is a direct range of `byticker`.
+    struct [[eosio::table]] Grant {
+		uint64_t id;
+		name owner;
+		symbol_code ticker;
+
+		uint64_t primary_key() const { return id; }
+		uint128_t by_ticker_owner() const { return get_ticker_owner_key(ticker, owner); }
+	};
+
+    struct AllowanceInfo {
+		name owner;
+		name spender;
+		asset allowance;
+	};
+
+    struct AllowancesResult {
+		std::vector<AllowanceInfo> allowances;
+		std::optional<name> cursor;
+	};
+
+    // Legacy layout, scoped by ticker (see `migrate`)
     struct [[eosio::table]] Allowance {
         uint64_t id;
 		name owner;
@@ -19,9 +79,14 @@ CONTRACT allowances : public contract {
 	};
 
     typedef eosio::multi_index<"accounts"_n, totems::Balance> balances_table;
+	typedef eosio::multi_index<"approvals"_n, Approval> approvals_table;
+	typedef eosio::multi_index<"nonces"_n, Nonce> nonces_table;
+	typedef eosio::multi_index<"grants"_n, Grant,
+		indexed_by<"byticker"_n, const_mem_fun<Grant, uint128_t, &Grant::by_ticker_owner>>
+	> grants_table;
 	typedef eosio::multi_index<"allowances"_n, Allowance,
 		indexed_by<"byownerspndr"_n, const_mem_fun<Allowance, uint128_t, &Allowance::by_owner_spender>>
-	> allowances_table;
+	> legacy_allowances_table;
 
 
     [[eosio::action]]
@@ -33,60 +98,66 @@ CONTRACT allowances : public contract {
 		check(quantity.is_valid(), "Invalid quantity.");
 		check(quantity.amount >= 0, "Cannot approve negative amount.");
 
-		allowances_table allowances(get_self(), quantity.symbol.code().raw());
-		auto index = allowances.get_index<"byownerspndr"_n>();
-		auto it = index.find(get_owner_spender_key(owner, spender));
-		if (it == index.end()) {
-			allowances.emplace(owner, [&](auto& row) {
-				row.id = allowances.available_primary_key();
-				row.owner = owner;
-				row.spender = spender;
-				row.allowance = quantity;
-			});
-		} else {
-			if(quantity.amount > 0){
-				index.modify(it, owner, [&](auto& row) {
-					row.allowance = quantity;
-				});
-			} else {
-				index.erase(it);
-			}
-		}
+		set_allowance(owner, owner, spender, quantity);
+		drop_legacy_allowance(owner, spender, quantity.symbol.code());
 	}
 
 	[[eosio::action]]
 	void spend(const name& owner, const name& spender, const name& recipient, const asset& quantity,const std::string& memo){
-		totems::check_license(quantity.symbol.code(), get_self());
+		spend_allowance(owner, spender, {{ recipient, quantity, memo }});
+	}
 
-		require_auth(spender);
-		check(quantity.is_valid(), "Invalid quantity.");
-		check(quantity.amount > 0, "Cannot spend negative amount.");
+	/***
+	  * Same as `spend`, paying many recipients at once.
+	  * The allowance and the owner's balance are checked against the totals and updated once.
+	  * @param owner - The owner of the totems
+	  * @param spender - The account spending the totems
+	  * @param payments - The recipient, quantity and memo of each transfer
+	  */
+	[[eosio::action]]
+	void spendmany(const name& owner, const name& spender, const std::vector<Payment>& payments){
+		check(payments.size() > 0, "At least one payment must be provided.");
+		spend_allowance(owner, spender, payments);
+	}
 
-		allowances_table allowances(get_self(), quantity.symbol.code().raw());
-		auto index = allowances.get_index<"byownerspndr"_n>();
-		auto it = index.find(get_owner_spender_key(owner, spender));
-		check(it != index.end(), "No allowance found for this spender.");
-		check(it->allowance.amount >= quantity.amount, "Insufficient allowance to spend.");
+	/***
+	  * Applies an allowance the owner signed off-chain, then spends from it like `spend`.
+	  * The permit must be signed by a key that satisfies the owner's active permission on its own.
+	  * @param permit - The signed permit, its nonce has to be the owner's next nonce (shared by all of the owner's spenders)
+	  * @param recipient - The account receiving the totems
+	  * @param quantity - The amount of totems to spend
+	  * @param memo - (optional) Any memo
+	  */
+	[[eosio::action]]
+	void permitspend(const Permit& permit, const name& recipient, const asset& quantity, const std::string& memo){
+		totems::check_license(permit.allowance.symbol.code(), get_self());
 
-		index.modify(it, same_payer, [&](auto& row) {
-			row.allowance -= quantity;
-		});
+		require_auth(permit.spender);
+		check(permit.allowance.is_valid(), "Invalid quantity.");
+		check(permit.allowance.amount >= 0, "Cannot approve negative amount.");
+		check(permit.deadline >= current_time_point(), "Permit has expired.");
 
-		balances_table balances(get_self(), owner.value);
-		auto bal_it = balances.find(quantity.symbol.code().raw());
-		check(bal_it != balances.end(), "Owner has no balance for this totem.");
-		check(bal_it->balance.amount >= quantity.amount, "Owner has insufficient balance.");
+		// the spender is the only one signing, so they pay for the nonce and allowance rows
+		nonces_table nonces(get_self(), get_self().value);
+		auto nonce = nonces.find(permit.owner.value);
+		check(permit.nonce == (nonce == nonces.end() ? 0 : nonce->next), "Invalid permit nonce.");
+		if(nonce == nonces.end()){
+			nonces.emplace(permit.spender, [&](auto& row) {
+				row.owner = permit.owner;
+				row.next = 1;
+			});
+		} else {
+			nonces.modify(nonce, same_payer, [&](auto& row) {
+				row.next++;
+			});
+		}
 
-		balances.modify(bal_it, same_payer, [&](auto& row) {
-			row.balance -= quantity;
-		});
+		auto key = recover_key(permit_digest(permit), permit.sig);
+		check(check_permission_authorization(permit.owner, "active"_n, { key }), "Invalid permit signature.");
 
-		totems::transfer(
-			get_self(),
-			recipient,
-			quantity,
-			std::move(memo)
-		);
+		set_allowance(permit.spender, permit.owner, permit.spender, permit.allowance);
+		drop_legacy_allowance(permit.owner, permit.spender, permit.allowance.symbol.code());
+		spend_allowance(permit.owner, permit.spender, {{ recipient, quantity, memo }});
 	}
 
 	[[eosio::action]]
@@ -129,17 +200,189 @@ CONTRACT allowances : public contract {
 		}
     }
 
+	/***
+	  * Closes an empty balance and gives back its RAM.
+	  * @param owner - The account closing the balance
+	  * @param ticker - The totem of the balance
+	  */
+	[[eosio::action]]
+	void close(const name& owner, const symbol& ticker){
+		require_auth(owner);
+
+		balances_table balances(get_self(), owner.value);
+		auto it = balances.find(ticker.code().raw());
+		check(it != balances.end(), "You have no balance for this totem.");
+		check(it->balance.amount == 0, "Balance must be zero to close.");
+		balances.erase(it);
+		open_quota::release_open_quota(get_self(), owner, ticker.code());
+	}
+
+	/***
+	  * Sets how many balance rows this contract pays for when deposits open them.
+	  * Rows opened this way count towards the quota until they're closed, so it also caps the RAM they can cost.
+	  * @param max - The max number of contract-paid balance rows, 0 turns auto-opening off
+	  */
+	[[eosio::action]]
+	void setquota(const uint64_t& max){
+		require_auth(get_self());
+		open_quota::set_quota(get_self(), max);
+	}
+
+
+	/***
+	  * Moves allowances from the legacy ticker-scoped `allowances` table into `approvals`.
+	  * Spending moves the allowances it uses over on the way, and `getapprovals` reads both layouts,
+	  * but `getbyspender` only sees migrated allowances, so run this for every ticker until it's empty after upgrading.
+	  * Allowances the owner has already set again since the upgrade are kept, their legacy rows are just dropped.
+	  * @param ticker - The totem whose allowances get migrated
+	  * @param limit - The max number of allowances to migrate in this call
+	  */
+	[[eosio::action]]
+	void migrate(const symbol_code& ticker, const uint32_t& limit){
+		require_auth(get_self());
+
+		legacy_allowances_table legacy(get_self(), ticker.raw());
+		auto it = legacy.begin();
+		uint32_t count = 0;
+		while(it != legacy.end() && count < limit){
+			if(!has_allowance(it->owner, it->spender, ticker)){
+				set_allowance(get_self(), it->owner, it->spender, it->allowance);
+			}
+			it = legacy.erase(it);
+			count++;
+		}
+	}
+
 	[[eosio::action, eosio::read_only]]
 	asset getallowance(const name& owner, const name& spender, const symbol& ticker){
-		allowances_table allowances(get_self(), ticker.code().raw());
-		auto index = allowances.get_index<"byownerspndr"_n>();
-		auto it = index.find(get_owner_spender_key(owner, spender));
-		if(it != index.end() && it->owner == owner){
-			return it->allowance;
+		approvals_table approvals(get_self(), owner.value);
+		auto it = approvals.find(spender.value);
+		if(it != approvals.end()){
+			auto index = find_allowance(it->allowances, ticker.code());
+			if(index >= 0){
+				return it->allowances[index];
+			}
+		}
+
+		// not migrated yet
+		legacy_allowances_table legacy(get_self(), ticker.code().raw());
+		auto legacy_index = legacy.get_index<"byownerspndr"_n>();
+		auto legacy_it = legacy_index.find(get_owner_spender_key(owner, spender));
+		if(legacy_it != legacy_index.end() && legacy_it->owner == owner){
+			return legacy_it->allowance;
 		}
 		return asset{0, ticker};
 	}
 
+	/***
+	  * Lists the allowances an owner has given for a totem, ordered by spender.
+	  * Allowances that haven't been migrated yet are merged in, the same way `getallowance` falls back to them.
+	  * @param owner - The account that gave the allowances
+	  * @param ticker - The totem
+	  * @param limit - The max number of spenders to look at, a page can have fewer (or no) allowances for this totem
+	  * @param cursor - (optional) The cursor returned by the previous page
+	  * @return The allowances, and the cursor to continue from or null when there's nothing left
+	  */
+	[[eosio::action, eosio::read_only]]
+	AllowancesResult getapprovals(
+		const name& owner,
+		const symbol& ticker,
+		const uint32_t& limit,
+		const std::optional<name>& cursor
+	){
+		AllowancesResult result;
+
+		approvals_table approvals(get_self(), owner.value);
+		auto itr = cursor.has_value()
+			? approvals.upper_bound(cursor->value)
+			: approvals.begin();
+
+		// the owner's legacy rows are a range of `byownerspndr`, in the same spender order
+		legacy_allowances_table legacy(get_self(), ticker.code().raw());
+		auto legacy_index = legacy.get_index<"byownerspndr"_n>();
+		auto legacy_itr = cursor.has_value()
+			? legacy_index.upper_bound(get_owner_spender_key(owner, cursor.value()))
+			: legacy_index.lower_bound(get_owner_spender_key(owner, name()));
+		auto has_legacy = [&](){ return legacy_itr != legacy_index.end() && legacy_itr->owner == owner; };
+
+		uint32_t count = 0;
+		while((itr != approvals.end() || has_legacy()) && count < limit){
+			if(itr != approvals.end() && (!has_legacy() || itr->spender.value <= legacy_itr->spender.value)){
+				auto index = find_allowance(itr->allowances, ticker.code());
+				bool same_spender = has_legacy() && legacy_itr->spender == itr->spender;
+				if(index >= 0){
+					result.allowances.push_back({ owner, itr->spender, itr->allowances[index] });
+				} else if(same_spender){
+					result.allowances.push_back({ owner, itr->spender, legacy_itr->allowance });
+				}
+				if(same_spender) ++legacy_itr;
+				result.cursor = itr->spender; // last visited key
+				++itr;
+			} else {
+				result.allowances.push_back({ owner, legacy_itr->spender, legacy_itr->allowance });
+				result.cursor = legacy_itr->spender;
+				++legacy_itr;
+			}
+			++count;
+		}
+
+		if(itr == approvals.end() && !has_legacy()){
+			result.cursor = std::nullopt;
+		}
+		return result;
+	}
+
+	/***
+	  * Lists the allowances a spender has been given for a totem, ordered by owner.
+	  * The legacy layout has no spender index, so allowances only show up here once they're migrated.
+	  * @param spender - The account that can spend
+	  * @param ticker - The totem
+	  * @param limit - The max number of allowances to return
+	  * @param cursor - (optional) The cursor returned by the previous page
+	  * @return The allowances, and the cursor to continue from or null when there's nothing left
+	  */
+	[[eosio::action, eosio::read_only]]
+	AllowancesResult getbyspender(
+		const name& spender,
+		const symbol& ticker,
+		const uint32_t& limit,
+		const std::optional<name>& cursor
+	){
+		AllowancesResult result;
+
+		grants_table grants(get_self(), spender.value);
+		auto index = grants.get_index<"byticker"_n>();
+		auto itr = cursor.has_value()
+			? index.upper_bound(get_ticker_owner_key(ticker.code(), cursor.value()))
+			: index.lower_bound(get_ticker_owner_key(ticker.code(), name()));
+		auto in_range = [&](){ return itr != index.end() && itr->ticker == ticker.code(); };
+
+		uint32_t count = 0;
+		while(in_range() && count < limit){
+			approvals_table approvals(get_self(), itr->owner.value);
+			const auto& approval = approvals.get(spender.value, "Allowance index is out of sync.");
+			auto position = find_allowance(approval.allowances, ticker.code());
+			check(position >= 0, "Allowance index is out of sync.");
+			result.allowances.push_back({ itr->owner, spender, approval.allowances[position] });
+			result.cursor = itr->owner; // last returned key
+			++itr;
+			++count;
+		}
+
+		if(!in_range()){
+			result.cursor = std::nullopt;
+		}
+		return result;
+	}
+
+	// The nonce the owner's next permit has to use
+	[[eosio::action, eosio::read_only]]
+	uint64_t getnonce(const name& owner){
+		nonces_table nonces(get_self(), get_self().value);
+		auto it = nonces.find(owner.value);
+		return it == nonces.end() ? 0 : it->next;
+	}
+
 	[[eosio::action, eosio::read_only]]
 	bool isopen(const name& owner, const symbol& ticker){
 		balances_table balances(get_self(), owner.value);
@@ -167,13 +410,189 @@ CONTRACT allowances : public contract {
 		if(to == get_self()){
 			balances_table balances(get_self(), from.value);
 			auto it = balances.find(quantity.symbol.code().raw());
-			check(it != balances.end(), "You must open a balance first.");
-			balances.modify(it, same_payer, [&](auto& a) { a.balance += quantity; });
+			if(it == balances.end()){
+				open_quota::use_open_quota(get_self(), from, quantity.symbol.code());
+				balances.emplace(get_self(), [&](auto& a) { a.balance = quantity; });
+			} else {
+				balances.modify(it, same_payer, [&](auto& a) { a.balance += quantity; });
+			}
 		}
     }
 
 private:
+	void spend_allowance(const name& owner, const name& spender, const std::vector<Payment>& payments){
+		// Summed as assets so that the addition is overflow checked
+		std::map<symbol, asset> totals;
+		for(const auto& payment : payments){
+			check(payment.quantity.is_valid(), "Invalid quantity.");
+			check(payment.quantity.amount > 0, "Cannot spend negative amount.");
+			auto [total, _] = totals.emplace(payment.quantity.symbol, asset{0, payment.quantity.symbol});
+			total->second += payment.quantity;
+		}
+		for(const auto& [sym, total] : totals){
+			totems::check_license(sym.code(), get_self());
+		}
+
+		require_auth(spender);
+
+		// before reading `approvals`, so this instance doesn't cache a row that changes underneath it
+		for(const auto& [sym, total] : totals){
+			migrate_allowance(owner, spender, sym.code());
+		}
+
+		approvals_table approvals(get_self(), owner.value);
+		auto it = approvals.find(spender.value);
+		check(it != approvals.end(), "No allowance found for this spender.");
+
+		std::vector<std::pair<int32_t, int64_t>> spent;
+		for(const auto& [sym, total] : totals){
+			auto index = find_allowance(it->allowances, sym.code());
+			check(index >= 0, "No allowance found for this spender.");
+			check(it->allowances[index].symbol == sym, "Symbol precision mismatch.");
+			check(it->allowances[index] >= total, "Insufficient allowance to spend.");
+			spent.push_back({index, total.amount});
+		}
+
+		approvals.modify(it, same_payer, [&](auto& row) {
+			for(const auto& [index, total] : spent){
+				row.allowances[index].amount -= total;
+			}
+		});
+
+		balances_table balances(get_self(), owner.value);
+		for(const auto& [sym, total] : totals){
+			auto bal_it = balances.find(sym.code().raw());
+			check(bal_it != balances.end(), "Owner has no balance for this totem.");
+			check(bal_it->balance >= total, "Owner has insufficient balance.");
+
+			balances.modify(bal_it, same_payer, [&](auto& row) {
+				row.balance -= total;
+			});
+		}
+
+		for(const auto& payment : payments){
+			totems::transfer(
+				get_self(),
+				payment.recipient,
+				payment.quantity,
+				payment.memo
+			);
+		}
+	}
+
+	// Sets (or removes, when zero) one totem's allowance in the owner's row for the spender
+	void set_allowance(const name& payer, const name& owner, const name& spender, const asset& quantity){
+		approvals_table approvals(get_self(), owner.value);
+		auto it = approvals.find(spender.value);
+		if(it == approvals.end()){
+			if(quantity.amount == 0) return;
+			approvals.emplace(payer, [&](auto& row) {
+				row.spender = spender;
+				row.allowances = { quantity };
+			});
+			index_spender(payer, owner, spender, quantity.symbol.code(), true);
+			return;
+		}
+
+		auto index = find_allowance(it->allowances, quantity.symbol.code());
+		if(quantity.amount == 0 && index < 0) return;
+		if(index < 0 || quantity.amount == 0){
+			index_spender(payer, owner, spender, quantity.symbol.code(), index < 0);
+		}
+		if(quantity.amount == 0 && it->allowances.size() == 1){
+			approvals.erase(it);
+			return;
+		}
+
+		approvals.modify(it, payer, [&](auto& row) {
+			if(index < 0){
+				row.allowances.push_back(quantity);
+			} else if(quantity.amount > 0){
+				row.allowances[index] = quantity;
+			} else {
+				row.allowances.erase(row.allowances.begin() + index);
+			}
+		});
+	}
+
+	// Whether `approvals` already has an allowance for this totem, so `migrate` doesn't overwrite it
+	bool has_allowance(const name& owner, const name& spender, const symbol_code& ticker){
+		approvals_table approvals(get_self(), owner.value);
+		auto it = approvals.find(spender.value);
+		return it != approvals.end() && find_allowance(it->allowances, ticker) >= 0;
+	}
+
+	// Moves a legacy allowance into `approvals` so it can be spent, unless it was already set again there.
+	// The contract pays for the new entry, like it does in `migrate`.
+	void migrate_allowance(const name& owner, const name& spender, const symbol_code& ticker){
+		legacy_allowances_table legacy(get_self(), ticker.raw());
+		auto index = legacy.get_index<"byownerspndr"_n>();
+		auto it = index.find(get_owner_spender_key(owner, spender));
+		if(it == index.end()) return;
+
+		if(!has_allowance(owner, spender, ticker)){
+			set_allowance(get_self(), owner, spender, it->allowance);
+		}
+		index.erase(it);
+	}
+
+	// Removes the legacy row for an allowance the owner just set, so `migrate` can't bring the old value back
+	void drop_legacy_allowance(const name& owner, const name& spender, const symbol_code& ticker){
+		legacy_allowances_table legacy(get_self(), ticker.raw());
+		auto index = legacy.get_index<"byownerspndr"_n>();
+		auto it = index.find(get_owner_spender_key(owner, spender));
+		if(it != index.end()){
+			index.erase(it);
+		}
+	}
+
+	// Adds or removes the spender's reverse lookup row for the owner's allowance of a totem
+	void index_spender(const name& payer, const name& owner, const name& spender, const symbol_code& ticker, bool add){
+		grants_table grants(get_self(), spender.value);
+		auto index = grants.get_index<"byticker"_n>();
+		auto it = index.find(get_ticker_owner_key(ticker, owner));
+		if(add == (it != index.end())) return;
+
+		if(add){
+			grants.emplace(payer, [&](auto& row) {
+				row.id = grants.available_primary_key();
+				row.owner = owner;
+				row.ticker = ticker;
+			});
+		} else {
+			index.erase(it);
+		}
+	}
+
+	// sha256 of the packed (domain, contract, owner, spender, allowance, nonce, deadline), so a permit
+	// can't be replayed against another deployment of this contract
+	checksum256 permit_digest(const Permit& permit){
+		auto data = pack(std::make_tuple(
+			"permit"_n,
+			get_self(),
+			permit.owner,
+			permit.spender,
+			permit.allowance,
+			permit.nonce,
+			permit.deadline
+		));
+		return sha256(data.data(), data.size());
+	}
+
+	static int32_t find_allowance(const std::vector<asset>& allowances, const symbol_code& ticker){
+		for(size_t i = 0; i < allowances.size(); i++){
+			if(allowances[i].symbol.code() == ticker){
+				return static_cast<int32_t>(i);
+			}
+		}
+		return -1;
+	}
+
 	static uint128_t get_owner_spender_key(const name& owner, const name& spender) {
 		return (uint128_t{owner.value} << 64) | spender.value;
 	}
+
+	static uint128_t get_ticker_owner_key(const symbol_code& ticker, const name& owner) {
+		return (uint128_t{ticker.raw()} << 64) | owner.value;
+	}
 };
\ No newline at end of file
@@ -18,6 +18,17 @@ CONTRACT innercircle : public contract {
 
     typedef eosio::multi_index<"members"_n, Member> members_table;
 
+    // Minter mods allocated on a totem can always transfer.
+    // Scoped to ticker, indexed from the totem's allocations so transfers don't need to decode it.
+    struct [[eosio::table]] Exempt {
+        name account;
+		uint64_t primary_key() const { return account.value; }
+    };
+
+    typedef eosio::multi_index<"exempt"_n, Exempt> exempt_table;
+
+    static constexpr name INDEXED_MARKER = name();
+
     [[eosio::action]]
     void togglemember(const symbol_code& ticker, const name& sponsor, const name& account){
         require_auth(sponsor);
@@ -53,11 +64,10 @@ CONTRACT innercircle : public contract {
 		}
 
 		// all minter mods are able to transfer
-		auto totem = totems::get_totem(quantity.symbol.code());
-		for(const auto& alloc : totem->allocations){
-			if(alloc.recipient == from || alloc.recipient == to){
-				if(alloc.is_minter) return;
-			}
+		exempt_table exempt(get_self(), quantity.symbol.code().raw());
+		index_exemptions(exempt, quantity.symbol.code());
+		if(exempt.find(from.value) != exempt.end() || exempt.find(to.value) != exempt.end()){
+			return;
 		}
 
 		members_table members(get_self(), quantity.symbol.code().raw());
@@ -92,4 +102,33 @@ CONTRACT innercircle : public contract {
 		auto owner_it = members.find(owner.value);
 		check(owner_it != members.end(), owner.to_string() + " is not a member!");
 	}
+
+	[[eosio::on_notify(TOTEMS_CREATED_NOTIFY)]]
+	void on_created(const name& creator, const symbol& ticker){
+		exempt_table exempt(get_self(), ticker.code().raw());
+		index_exemptions(exempt, ticker.code());
+	}
+
+private:
+	// Fills the exemptions for a ticker from its allocations, only once per ticker.
+	// A row for the empty name marks the ticker as indexed, no account can have that name so it never exempts anyone.
+	void index_exemptions(exempt_table& exempt, const symbol_code& ticker){
+		if(exempt.find(INDEXED_MARKER.value) != exempt.end()){
+			return;
+		}
+
+		auto& totem = totems::get_totem_view(ticker);
+		check(totem.exists(), "Totem does not exist");
+
+		exempt.emplace(get_self(), [&](auto& row){
+			row.account = INDEXED_MARKER;
+		});
+		for(const auto& alloc : totem.allocations()){
+			if(alloc.is_minter.value_or(false) && exempt.find(alloc.recipient.value) == exempt.end()){
+				exempt.emplace(get_self(), [&](auto& row){
+					row.account = alloc.recipient;
+				});
+			}
+		}
+	}
 };
\ No newline at end of file
@@ -25,6 +25,18 @@ CONTRACT kyc : public contract {
 
     using kyc_table = eosio::multi_index<"kyc"_n, KYC>;
 
+    // Minter mods allocated on a totem are exempt from KYC.
+    // Scoped to ticker, indexed from the totem's allocations so transfers don't need to decode it.
+    struct [[eosio::table]] Exempt {
+        name account;
+
+        uint64_t primary_key() const { return account.value; }
+    };
+
+    using exempt_table = eosio::multi_index<"exempt"_n, Exempt>;
+
+    static constexpr name INDEXED_MARKER = name();
+
     [[eosio::action]]
     void addmanager(name manager) {
 		require_auth(get_self());
@@ -64,30 +76,24 @@ CONTRACT kyc : public contract {
             return;
         }
 
-        auto totem = totems::get_totem(quantity.symbol.code());
-        check(totem.has_value(), "Totem does not exist");
+        exempt_table exempt(get_self(), quantity.symbol.code().raw());
+        index_exemptions(exempt, quantity.symbol.code());
+
+        check_kyc(from, exempt);
+        check_kyc(to, exempt);
+    }
 
-        check_kyc(from, totem->allocations);
-        check_kyc(to, totem->allocations);
+    [[eosio::on_notify(TOTEMS_CREATED_NOTIFY)]]
+    void on_created(const name& creator, const symbol& ticker) {
+        exempt_table exempt(get_self(), ticker.code().raw());
+        index_exemptions(exempt, ticker.code());
     }
 
    private:
-    void check_kyc(const name& user, const std::vector<totems::MintAllocation>& allocations) {
+    void check_kyc(const name& user, const exempt_table& exempt) {
         // Minter mods are exempt from KYC
-        if (!allocations.empty()) {
-			auto allocated_user = std::find_if(
-				allocations.begin(),
-				allocations.end(),
-				[&](const totems::MintAllocation& alloc) {
-					return alloc.recipient == user;
-				}
-			);
-
-			if (allocated_user != allocations.end()){
-				if(allocated_user->is_minter.has_value() && allocated_user->is_minter.value() == true){
-					return;
-				}
-			}
+        if (exempt.find(user.value) != exempt.end()) {
+			return;
 		}
 
         kyc_table kyc(get_self(), get_self().value);
@@ -95,6 +101,24 @@ CONTRACT kyc : public contract {
         check(itr != kyc.end(), "KYC required.");
     }
 
+    // Fills the exemptions for a ticker from its allocations, only once per ticker.
+    // A row for the empty name marks the ticker as indexed, no account can have that name so it never exempts anyone.
+    void index_exemptions(exempt_table& exempt, const symbol_code& ticker) {
+        if (exempt.find(INDEXED_MARKER.value) != exempt.end()) {
+            return;
+        }
+
+        auto& totem = totems::get_totem_view(ticker);
+        check(totem.exists(), "Totem does not exist");
+
+        exempt.emplace(get_self(), [&](auto& row) { row.account = INDEXED_MARKER; });
+        for (const auto& alloc : totem.allocations()) {
+            if (alloc.is_minter.value_or(false) && exempt.find(alloc.recipient.value) == exempt.end()) {
+                exempt.emplace(get_self(), [&](auto& row) { row.account = alloc.recipient; });
+            }
+        }
+    }
+
     void check_manager(const name& signer) {
 		managers_table managers(get_self(), get_self().value);
 		auto itr = managers.find(signer.value);
@@ -0,0 +1,97 @@
+#pragma once
+#include <eosio/eosio.hpp>
+#include <eosio/asset.hpp>
+
+using namespace eosio;
+
+/*
+ * Open Quota
+ * ----------------
+ * Lets a custodial mod open balance rows on deposit at its own expense, capped by a quota.
+ * Deposits arrive as notifications, which can't bill the depositor for RAM, so without this every
+ * first deposit needs its own `open` transaction.
+ * ----------------
+ * > Note about table definitions: unlike the ones in totems.hpp, the tables here ARE put into your ABI,
+ * > they live in your contract under `openquota` and `sponsored`.
+ * ----------------
+ */
+namespace open_quota {
+
+	static constexpr uint64_t DEFAULT_OPEN_QUOTA = 1000;
+
+	// How many balance rows the contract pays for when a deposit opens them
+	struct [[eosio::table]] OpenQuota {
+		uint64_t max;
+		uint64_t used;
+
+		uint64_t primary_key() const { return 0; }
+	};
+
+	// Balance rows the contract paid for when a deposit opened them, scoped by owner.
+	// Closing one gives its slot back to the quota.
+	struct [[eosio::table]] Sponsored {
+		symbol_code ticker;
+
+		uint64_t primary_key() const { return ticker.raw(); }
+	};
+
+	typedef eosio::multi_index<"openquota"_n, OpenQuota> open_quota_table;
+	typedef eosio::multi_index<"sponsored"_n, Sponsored> sponsored_table;
+
+	// Sets the max number of contract-paid balance rows, rows that are already open keep counting towards it
+	void set_quota(const name& contract, const uint64_t& max){
+		open_quota_table quota(contract, contract.value);
+		auto it = quota.find(0);
+		if(it == quota.end()){
+			quota.emplace(contract, [&](auto& row) {
+				row.max = max;
+				row.used = 0;
+			});
+		} else {
+			quota.modify(it, same_payer, [&](auto& row) {
+				row.max = max;
+			});
+		}
+	}
+
+	// Takes one contract-paid balance row from the quota, deposits can't bill the depositor for RAM
+	void use_open_quota(const name& contract, const name& owner, const symbol_code& ticker){
+		open_quota_table quota(contract, contract.value);
+		auto it = quota.find(0);
+		uint64_t max = it == quota.end() ? DEFAULT_OPEN_QUOTA : it->max;
+		uint64_t used = it == quota.end() ? 0 : it->used;
+		check(used < max, "You must open a balance first.");
+
+		if(it == quota.end()){
+			quota.emplace(contract, [&](auto& row) {
+				row.max = max;
+				row.used = 1;
+			});
+		} else {
+			quota.modify(it, same_payer, [&](auto& row) {
+				row.used++;
+			});
+		}
+
+		sponsored_table sponsored(contract, owner.value);
+		sponsored.emplace(contract, [&](auto& row) {
+			row.ticker = ticker;
+		});
+	}
+
+	// Gives a closed balance's slot back to the quota, if the contract paid for it
+	void release_open_quota(const name& contract, const name& owner, const symbol_code& ticker){
+		sponsored_table sponsored(contract, owner.value);
+		auto it = sponsored.find(ticker.raw());
+		if(it == sponsored.end()) return;
+		sponsored.erase(it);
+
+		open_quota_table quota(contract, contract.value);
+		auto quota_it = quota.find(0);
+		if(quota_it != quota.end() && quota_it->used > 0){
+			quota.modify(quota_it, same_payer, [&](auto& row) {
+				row.used--;
+			});
+		}
+	}
+}
@@ -15,6 +15,8 @@ using namespace eosio;
  * > Note about contract size: Don't worry about this adding to your contract size, as long as you only use what you need from it.
  * > I tested this with an empty contract with and without the library and it only adds 83 bytes
  * > or +0.0264 A or $0.0043619 at the time of writing this doc.
+ * > The read cache behind the lookup helpers is a few linked lists on purpose, std::map would pull the
+ * > red-black tree code into every mod that reads a totem.
  * ----------------
  * > Note about table definitions: The tables here WILL NOT be put into your ABI. They are only used
  * > for reading data from the Totems and Mods contracts. Your contract's ABI will only include tables
@@ -32,6 +34,12 @@ using namespace eosio;
 #define TOTEMS_CLOSE_NOTIFY "totemstotems::close"
 #define TOTEMS_CREATED_NOTIFY "totemstotems::created"
 
+// Where `totems::check_license` looks for licenses on this network (see `LicensePolicy`).
+// Networks without the proxy mod should use DIRECT_ONLY so mods skip the proxy lookup entirely.
+// Can also be overridden at build time with -DTOTEMS_LICENSE_POLICY=...
+#ifndef TOTEMS_LICENSE_POLICY
+#define TOTEMS_LICENSE_POLICY DIRECT_THEN_PROXY
+#endif
 
 namespace totems {
 
@@ -40,6 +48,20 @@ namespace totems {
 	static const name TOTEMS_CONTRACT = "totemstotems"_n;
 	static const name PROXY_MOD_CONTRACT = "totemodproxy"_n;
 
+	// Which license tables `check_license` probes, and in which order
+	enum class LicensePolicy : uint8_t {
+		// Only mods licensed directly on the totem
+		DIRECT_ONLY,
+		// Only mods licensed through the proxy mod
+		PROXY_ONLY,
+		// Direct licenses first, then the proxy
+		DIRECT_THEN_PROXY,
+		// Proxy licenses first, then direct (for tickers that are known to be proxied)
+		PROXY_THEN_DIRECT
+	};
+
+	static constexpr LicensePolicy LICENSE_POLICY = LicensePolicy::TOTEMS_LICENSE_POLICY;
+
 	/* ---------------- MOD MARKET ---------------- */
 
 	// Defines the type of param in required_actions
@@ -134,15 +156,167 @@ namespace totems {
 
 	typedef eosio::multi_index<"mods"_n, Mod> mods_table;
 
-	// Fetches a mod from the market, or nullopt if it doesn't exist
-	std::optional<Mod> get_mod(const name& contract) {
-	    mods_table mods(MARKET_CONTRACT, MARKET_CONTRACT.value);
-	    auto mod = mods.find(contract.value);
-	    if (mod == mods.end()) {
-	        return std::nullopt;
+	/***
+	  * A lazy, read-only view over a mod row in the market.
+	  * `ModDetails` (markdown especially) can be kilobytes, and most on-chain callers only need
+	  * the price, seller, hooks or a single hook's required actions. This reads the raw row and
+	  * steps over the details without decoding them:
+	  * - seller/price only read the fixed-size head of the row
+	  * - has_hook/hooks/append_required_actions read the full row once, then walk it in place
+	  */
+	class ModView {
+	public:
+	    explicit ModView(const name& contract)
+	        : itr(internal_use_do_not_use::db_find_i64(MARKET_CONTRACT.value, MARKET_CONTRACT.value, "mods"_n.value, contract.value)) {}
+
+	    bool exists() const { return itr >= 0; }
+
+	    name seller() { load_head(); return _seller; }
+	    uint64_t price() { load_head(); return _price; }
+
+	    bool has_hook(const name& hook) {
+	        auto ds = stream_at(hooks_offset());
+	        unsigned_int count;
+	        ds >> count;
+	        for(uint32_t i = 0; i < count.value; i++){
+	            name h;
+	            ds >> h;
+	            if(h == hook) return true;
+	        }
+	        return false;
+	    }
+
+	    std::set<name> hooks() {
+	        auto ds = stream_at(hooks_offset());
+	        std::set<name> hooks;
+	        ds >> hooks;
+	        return hooks;
 	    }
-	    return *mod;
-	}
+
+	    /***
+	      * Appends the required actions for a single hook onto `out`.
+	      * Only that hook's actions get decoded, everything else is stepped over.
+	      */
+	    void append_required_actions(const name& hook, std::vector<RequiredAction>& out) {
+	        auto ds = stream_at(required_actions_offset());
+	        unsigned_int hook_count;
+	        ds >> hook_count;
+	        for(uint32_t i = 0; i < hook_count.value; i++){
+	            name h;
+	            unsigned_int action_count;
+	            ds >> h >> action_count;
+	            for(uint32_t j = 0; j < action_count.value; j++){
+	                if(h == hook){
+	                    out.emplace_back();
+	                    ds >> out.back();
+	                } else {
+	                    skip_required_action(ds);
+	                }
+	            }
+	        }
+	    }
+
+	    // Decodes the full row, same as `get_mod`
+	    Mod mod() {
+	        load_row();
+	        return unpack<Mod>(row.data(), row.size());
+	    }
+
+	private:
+	    // contract + seller + price
+	    static constexpr uint32_t HEAD_SIZE = 8 + 8 + 8;
+	    // the string fields in ModDetails, followed by is_minter
+	    static constexpr uint32_t DETAILS_STRINGS = 6;
+
+	    int32_t itr;
+	    bool head_loaded = false;
+	    name _seller;
+	    uint64_t _price = 0;
+	    std::vector<char> row;
+	    uint32_t _hooks_offset = 0;
+
+	    void load_head() {
+	        if(head_loaded) return;
+	        check(exists(), "Mod is not published in market");
+
+	        char head[HEAD_SIZE];
+	        internal_use_do_not_use::db_get_i64(itr, head, HEAD_SIZE);
+	        datastream<const char*> ds(head, HEAD_SIZE);
+	        name contract;
+	        ds >> contract >> _seller >> _price;
+	        head_loaded = true;
+	    }
+
+	    void load_row() {
+	        if(!row.empty()) return;
+	        check(exists(), "Mod is not published in market");
+
+	        auto size = internal_use_do_not_use::db_get_i64(itr, nullptr, 0);
+	        row.resize(size);
+	        internal_use_do_not_use::db_get_i64(itr, row.data(), size);
+	    }
+
+	    datastream<const char*> stream_at(uint32_t offset) {
+	        load_row();
+	        return datastream<const char*>(row.data() + offset, row.size() - offset);
+	    }
+
+	    // Where `hooks` starts, past the details and score
+	    uint32_t hooks_offset() {
+	        if(_hooks_offset > 0) return _hooks_offset;
+	        auto ds = stream_at(HEAD_SIZE);
+	        for(uint32_t i = 0; i < DETAILS_STRINGS; i++){
+	            skip_bytes(ds);
+	        }
+	        // is_minter + score
+	        ds.skip(sizeof(bool) + sizeof(int64_t));
+	        _hooks_offset = HEAD_SIZE + ds.tellp();
+	        return _hooks_offset;
+	    }
+
+	    // Where `required_actions` starts, past the hooks
+	    uint32_t required_actions_offset() {
+	        auto ds = stream_at(hooks_offset());
+	        unsigned_int count;
+	        ds >> count;
+	        return hooks_offset() + ds.tellp() + count.value * sizeof(name);
+	    }
+
+	    // Skips a length-prefixed string or byte vector
+	    static void skip_bytes(datastream<const char*>& ds) {
+	        unsigned_int size;
+	        ds >> size;
+	        ds.skip(size.value);
+	    }
+
+	    static void skip_optional_u64(datastream<const char*>& ds) {
+	        bool has_value;
+	        ds >> has_value;
+	        if(has_value) ds.skip(sizeof(uint64_t));
+	    }
+
+	    static void skip_required_action(datastream<const char*>& ds) {
+	        // contract + action
+	        ds.skip(sizeof(name) * 2);
+	        unsigned_int field_count;
+	        ds >> field_count;
+	        for(uint32_t i = 0; i < field_count.value; i++){
+	            // param
+	            skip_bytes(ds);
+	            // type
+	            ds.skip(sizeof(uint8_t));
+	            // data
+	            skip_bytes(ds);
+	            // offset + size
+	            ds.skip(sizeof(uint16_t) * 2);
+	            // min + max
+	            skip_optional_u64(ds);
+	            skip_optional_u64(ds);
+	        }
+	        // purpose
+	        skip_bytes(ds);
+	    }
+	};
 
 	/* ---------------- TOTEMS ---------------- */
 	// Balance table for each account
@@ -217,18 +391,216 @@ namespace totems {
 	// TODO: Maybe add some indices here for sorting by mints, burns, holders, etc?
 	typedef eosio::multi_index<"totemstats"_n, TotemStats> totemstats_table;
 
+	/***
+	  * A lazy, read-only view over a totem row.
+	  * `get_totem` decodes the entire row (details, mods, allocation labels, ...) even when you
+	  * only need the creator. This reads the raw row bytes directly and only decodes what you touch:
+	  * - creator/supply/max_supply only read the fixed-size head of the row
+	  * - allocations/is_minter read the full row once and walk it as needed
+	  * Prefer this in notification handlers, which run on every transfer/mint/burn, and get it through
+	  * `get_totem_view` so that it is shared for the rest of the action.
+	  */
+	class TotemView {
+	public:
+	    explicit TotemView(const symbol_code& code)
+	        : itr(internal_use_do_not_use::db_find_i64(TOTEMS_CONTRACT.value, TOTEMS_CONTRACT.value, "totems"_n.value, code.raw())) {}
+
+	    bool exists() const { return itr >= 0; }
+
+	    name creator() { load_head(); return _creator; }
+	    asset supply() { load_head(); return _supply; }
+	    asset max_supply() { load_head(); return _max_supply; }
+
+	    std::vector<MintAllocation> allocations() {
+	        load_row();
+	        datastream<const char*> ds(row.data() + HEAD_SIZE, row.size() - HEAD_SIZE);
+	        std::vector<MintAllocation> allocations;
+	        ds >> allocations;
+	        return allocations;
+	    }
+
+	    /***
+	      * Whether the account was allocated supply as a minter (minter mods).
+	      * Walks the allocations in place without decoding labels or quantities.
+	      */
+	    bool is_minter(const name& account) {
+	        load_row();
+	        datastream<const char*> ds(row.data() + HEAD_SIZE, row.size() - HEAD_SIZE);
+	        unsigned_int count;
+	        ds >> count;
+	        for(uint32_t i = 0; i < count.value; i++){
+	            unsigned_int label_size;
+	            ds >> label_size;
+	            ds.skip(label_size.value);
+
+	            name recipient;
+	            ds >> recipient;
+	            ds.skip(ASSET_SIZE);
+
+	            std::optional<bool> is_minter;
+	            ds >> is_minter;
+	            if(recipient == account && is_minter.value_or(false)){
+	                return true;
+	            }
+	        }
+	        return false;
+	    }
+
+	    // Decodes the full row, same as `get_totem`
+	    Totem totem() {
+	        load_row();
+	        return unpack<Totem>(row.data(), row.size());
+	    }
+
+	private:
+	    // asset = int64_t amount + symbol
+	    static constexpr uint32_t ASSET_SIZE = 16;
+	    // creator + supply + max_supply
+	    static constexpr uint32_t HEAD_SIZE = 8 + ASSET_SIZE * 2;
+
+	    int32_t itr;
+	    bool head_loaded = false;
+	    name _creator;
+	    asset _supply;
+	    asset _max_supply;
+	    std::vector<char> row;
+
+	    void load_head() {
+	        if(head_loaded) return;
+	        check(exists(), "Totem does not exist");
+
+	        // db_get_i64 only copies as many bytes as we ask for, so the rest of the row is never touched
+	        char head[HEAD_SIZE];
+	        internal_use_do_not_use::db_get_i64(itr, head, HEAD_SIZE);
+	        datastream<const char*> ds(head, HEAD_SIZE);
+	        ds >> _creator >> _supply >> _max_supply;
+	        head_loaded = true;
+	    }
+
+	    void load_row() {
+	        if(!row.empty()) return;
+	        check(exists(), "Totem does not exist");
+
+	        auto size = internal_use_do_not_use::db_get_i64(itr, nullptr, 0);
+	        row.resize(size);
+	        internal_use_do_not_use::db_get_i64(itr, row.data(), size);
+	    }
+	};
+
+	/* ---------------- READ CACHE ---------------- */
+	// Every action runs in a fresh contract instance, so static storage only lives for a single action.
+	// That makes it a free per-action cache for foreign rows: another contract's tables can't change
+	// while we're executing (inline actions only run after we return), so the first read stays valid
+	// for the rest of the action. Rows owned by the executing contract are never cached since it may
+	// be writing to them.
+	// All of the helpers below go through this, so calling them repeatedly in one handler is cheap.
+	// Build with -DTOTEMS_DEBUG and call `print_read_cache_stats()` to see the hits/misses.
+	// Kept as tiny linked lists rather than std::map so using the cache doesn't pull the map/tree
+	// code into every mod. An action only touches a handful of rows, so the linear lookup is fine,
+	// and entries are never freed (the instance dies with the action) so references stay valid.
+	struct CacheKey {
+	    uint64_t a = 0;
+	    uint64_t b = 0;
+	    uint64_t c = 0;
+	    bool operator==(const CacheKey& other) const { return a == other.a && b == other.b && c == other.c; }
+	};
+
+	template <typename V>
+	struct CacheEntry {
+	    CacheKey key;
+	    V value;
+	    CacheEntry* next;
+	};
+
+	struct ReadCache {
+	    CacheEntry<TotemView>* totems = nullptr;
+	    CacheEntry<ModView>* mod_views = nullptr;
+	    CacheEntry<std::optional<Mod>>* mods = nullptr;
+	    // (contract, ticker, mod) -> has license
+	    CacheEntry<bool>* licenses = nullptr;
+	    // (contract, owner, ticker) -> balance, nullopt if there is no balance row
+	    CacheEntry<std::optional<asset>>* balances = nullptr;
+	#ifdef TOTEMS_DEBUG
+	    uint32_t hits = 0;
+	    uint32_t misses = 0;
+	#endif
+	};
+
+	ReadCache& read_cache() {
+	    static ReadCache cache;
+	    return cache;
+	}
+
+	// `owner` is the contract whose table is read, reads of the executing contract's own tables skip the cache.
+	// Those still get an entry of their own (outside the list) so views can be handed out by reference.
+	template <typename V, typename Fetch>
+	V& cached_read(CacheEntry<V>*& entries, const name& owner, const CacheKey& key, Fetch&& fetch) {
+	    if (owner == current_receiver()) {
+	        return (new CacheEntry<V>{key, fetch(), nullptr})->value;
+	    }
+	    for (auto* entry = entries; entry != nullptr; entry = entry->next) {
+	        if (entry->key == key) {
+	        #ifdef TOTEMS_DEBUG
+	            read_cache().hits++;
+	        #endif
+	            return entry->value;
+	        }
+	    }
+	#ifdef TOTEMS_DEBUG
+	    read_cache().misses++;
+	#endif
+	    entries = new CacheEntry<V>{key, fetch(), entries};
+	    return entries->value;
+	}
+
+	#ifdef TOTEMS_DEBUG
+	void print_read_cache_stats() {
+	    print("totems read cache: ", read_cache().hits, " hits, ", read_cache().misses, " misses\n");
+	}
+	#endif
+
+	/***
+	  * Fetches a lazy view of a mod in the market.
+	  * Prefer this over `get_mod` when you only need the price, seller, hooks or required actions.
+	  * @param contract - The mod contract
+	  * @return A ModView, check `exists()` before reading from it
+	  */
+	ModView& get_mod_view(const name& contract) {
+	    return cached_read(read_cache().mod_views, MARKET_CONTRACT, CacheKey{contract.value}, [&]() { return ModView(contract); });
+	}
+
+	// Fetches a mod from the market, or nullopt if it doesn't exist
+	std::optional<Mod> get_mod(const name& contract) {
+	    return cached_read(read_cache().mods, MARKET_CONTRACT, CacheKey{contract.value}, [&]() -> std::optional<Mod> {
+	        auto& mod = get_mod_view(contract);
+	        if (!mod.exists()) {
+	            return std::nullopt;
+	        }
+	        return mod.mod();
+	    });
+	}
+
+	/***
+	  * Fetches a lazy view of a totem by its ticker symbol code.
+	  * The view is shared for the rest of the action, so anything it has already decoded is free.
+	  * @param code - The symbol code of the totem/ticker
+	  * @return A TotemView, check `exists()` before reading from it
+	  */
+	TotemView& get_totem_view(const symbol_code& code) {
+	    return cached_read(read_cache().totems, TOTEMS_CONTRACT, CacheKey{code.raw()}, [&]() { return TotemView(code); });
+	}
+
 	/***
 	  * Fetches a totem by its ticker symbol code
 	  * @param code - The symbol code of the totem/ticker
 	  * @return An optional Totem struct, nullopt if it doesn't exist
 	  */
 	std::optional<Totem> get_totem(const symbol_code& code) {
-	    totems_table totems(TOTEMS_CONTRACT, TOTEMS_CONTRACT.value);
-	    auto totem = totems.find(code.raw());
-	    if (totem == totems.end()) {
+	    auto& totem = get_totem_view(code);
+	    if (!totem.exists()) {
 	        return std::nullopt;
 	    }
-	    return *totem;
+	    return totem.totem();
 	}
 
 	/***
@@ -238,9 +610,7 @@ namespace totems {
 	  */
     // TODO: nullopt or error?
 	name get_totem_creator(const symbol_code& code) {
-	    auto totem = get_totem(code);
-	    check(totem.has_value(), "Totem does not exist");
-	    return totem.value().creator;
+	    return get_totem_view(code).creator();
 	}
 
 	/***
@@ -250,12 +620,17 @@ namespace totems {
 	  * @return The asset balance of the totem for the account or 0 if none
 	  */
 	asset get_balance(const name& owner, const symbol& ticker, const name& contract = TOTEMS_CONTRACT) {
-	    balances_table balances(contract, owner.value);
-	    auto it = balances.find(ticker.code().raw());
-	    if (it == balances.end()) {
-	        return asset{0, ticker};
-	    }
-	    return it->balance;
+	    auto fetch = [&]() -> std::optional<asset> {
+	        balances_table balances(contract, owner.value);
+	        auto it = balances.find(ticker.code().raw());
+	        if (it == balances.end()) {
+	            return std::nullopt;
+	        }
+	        return it->balance;
+	    };
+
+	    auto balance = cached_read(read_cache().balances, contract, CacheKey{contract.value, owner.value, ticker.code().raw()}, fetch);
+	    return balance.value_or(asset{0, ticker});
 	}
 
 	/***
@@ -282,16 +657,36 @@ namespace totems {
 	// scoped to ticker (symbol_code)
     typedef eosio::multi_index<"licenses"_n, License> license_table;
 
+	// Whether `contract` holds a license for the mod on this ticker
+	bool has_license(const name& contract, const symbol_code& ticker, const name& mod){
+		auto fetch = [&](){
+			license_table licenses(contract, ticker.raw());
+			return licenses.find(mod.value) != licenses.end();
+		};
+
+		return cached_read(read_cache().licenses, contract, CacheKey{contract.value, ticker.raw(), mod.value}, fetch);
+	}
+
+	/***
+	  * Checks that the mod is licensed for the totem, either directly or through the proxy mod.
+	  * The lookup order is picked at compile time, defaulting to the network's LICENSE_POLICY.
+	  * If you know a ticker is proxied you can check the proxy first with:
+	  * `check_license<LicensePolicy::PROXY_THEN_DIRECT>(ticker, get_self())`
+	  * > No need for an `is_account` check on the proxy, a lookup against an account with no table
+	  * > just comes back empty.
+	  */
+	template <LicensePolicy Policy = LICENSE_POLICY>
 	void check_license(const symbol_code& ticker, const name& mod){
-		{
-			license_table licenses(TOTEMS_CONTRACT, ticker.raw());
-			if(licenses.find(mod.value) != licenses.end()) return;
-		}
-		{
-			if(is_account(PROXY_MOD_CONTRACT)){
-				license_table licenses(PROXY_MOD_CONTRACT, ticker.raw());
-				if(licenses.find(mod.value) != licenses.end()) return;
-			}
+		if constexpr (Policy == LicensePolicy::DIRECT_ONLY) {
+			if(has_license(TOTEMS_CONTRACT, ticker, mod)) return;
+		} else if constexpr (Policy == LicensePolicy::PROXY_ONLY) {
+			if(has_license(PROXY_MOD_CONTRACT, ticker, mod)) return;
+		} else if constexpr (Policy == LicensePolicy::DIRECT_THEN_PROXY) {
+			if(has_license(TOTEMS_CONTRACT, ticker, mod)) return;
+			if(has_license(PROXY_MOD_CONTRACT, ticker, mod)) return;
+		} else {
+			if(has_license(PROXY_MOD_CONTRACT, ticker, mod)) return;
+			if(has_license(TOTEMS_CONTRACT, ticker, mod)) return;
 		}
 
 		check(false, "Mod is not licensed for this totem: " + mod.to_string());
@@ -304,19 +699,10 @@ namespace totems {
 	std::vector<RequiredAction> get_required_actions(const name& hook, const std::vector<name>& mod_names) {
 	    std::vector<RequiredAction> required_actions;
 	    for (const auto& mod_name : mod_names) {
-	        auto mod = get_mod(mod_name);
-	        check(mod.has_value(), "Mod is not published in market: " + mod_name.to_string());
-	        check(mod.value().has_hook(hook), "Mod does not support required hook: " + hook.to_string());
-	        // TODO: More performant way to do this?
-	        for (const auto& req_hook : mod.value().required_actions) {
-	            if (req_hook.hook == hook) {
-	                required_actions.insert(
-	                    required_actions.end(),
-	                    req_hook.actions.begin(),
-	                    req_hook.actions.end()
-	                );
-	            }
-	        }
+	        auto& mod = get_mod_view(mod_name);
+	        check(mod.exists(), "Mod is not published in market: " + mod_name.to_string());
+	        check(mod.has_hook(hook), "Mod does not support required hook: " + hook.to_string());
+	        mod.append_required_actions(hook, required_actions);
 	    }
 	    return required_actions;
 	}
@@ -50,8 +50,7 @@ CONTRACT miner : public contract {
 		totems::check_license(quantity.symbol.code(), get_self());
 		check(payment.amount == 0, "Miner mod does not accept payment");
 
-		auto totem = totems::get_totem(quantity.symbol.code());
-		check(totem.has_value(), "Totem does not exist for this ticker");
+		check(totems::get_totem_view(quantity.symbol.code()).exists(), "Totem does not exist for this ticker");
 
 		config_table configs(get_self(), get_self().value);
 		auto config = configs.find(quantity.symbol.code().raw());
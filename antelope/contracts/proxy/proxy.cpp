@@ -11,6 +11,15 @@ CONTRACT proxy : public contract {
    public:
     using contract::contract;
 
+    // The mods subscribed to a single hook of a totem.
+    // Scoped to ticker, so a notification only reads (and add/remove only rewrites) the hook it's for.
+    struct [[eosio::table]] Subscribers {
+        name hook;
+        std::vector<name> mods;
+		uint64_t primary_key() const { return hook.value; }
+    };
+
+    // Legacy layout with every hook in one row, moved into `subscribers` by `migrate` or the first time the ticker is configured
     struct [[eosio::table]] Proxy {
         symbol_code ticker;
         std::vector<name> transfer;
@@ -22,79 +31,155 @@ CONTRACT proxy : public contract {
 		uint64_t primary_key() const { return ticker.raw(); }
     };
 
+    // Set by `migrate` once `proxies` is empty, so notifications stop looking for legacy rows
+    struct [[eosio::table]] MigrationState {
+        bool done;
+		uint64_t primary_key() const { return 0; }
+    };
+
+    typedef eosio::multi_index<"subscribers"_n, Subscribers> subscribers_table;
+    typedef eosio::multi_index<"migration"_n, MigrationState> migration_table;
     typedef eosio::multi_index<"proxies"_n, Proxy> proxy_table;
     typedef eosio::multi_index<"licenses"_n, totems::License> license_table;
 
+    // A mod on some hooks of a totem, used for batch configuration
+    struct ProxyConfig {
+        symbol_code ticker;
+        name mod;
+        std::vector<name> hooks;
+    };
+
     [[eosio::action]]
     void add(
         const symbol_code& ticker,
         const std::vector<name>& hooks,
         const name& mod
     ){
-        require_auth(totems::get_totem_creator(ticker));
-        check(hooks.size() > 0, "At least one hook must be provided");
-
-        auto _mod = totems::get_mod(mod);
-        check(_mod.has_value(), "Mod is not published in market");
-        for(const auto& hook : hooks){
-			check(_mod.value().has_hook(hook), "Mod does not support required hook: " + hook.to_string());
-		}
-        auto price = _mod.value().price;
-        if(price > 0){
-            shared::ensure_tokens_available(price, get_self());
-            shared::dispense_tokens(get_self(), {
-				shared::FeeDisbursement{
-					.recipient = _mod.value().seller,
-					.amount = price
-				}
-			});
-        }
+        add_configs({ ProxyConfig{ .ticker = ticker, .mod = mod, .hooks = hooks } });
+    }
 
-        totems::license_table licenses(get_self(), ticker.raw());
-        auto it_license = licenses.find(mod.value);
-        if(it_license == licenses.end()){
-			licenses.emplace(get_self(), [&](auto& row){
-				row.mod = mod;
-			});
+	[[eosio::action]]
+	void remove(const symbol_code& ticker, const name& hook, const name& mod){
+		remove_configs({ ProxyConfig{ .ticker = ticker, .mod = mod, .hooks = { hook } } });
+	}
+
+	/***
+	  * Same as `add`, for many tickers and mods at once.
+	  * Each totem and mod is only read once, each hook row is only written once, and fees are
+	  * aggregated per seller.
+	  * @param configs - The (ticker, mod, hooks) to add
+	  */
+	[[eosio::action]]
+	void addmany(const std::vector<ProxyConfig>& configs){
+		check(configs.size() > 0, "At least one configuration must be provided");
+		add_configs(configs);
+	}
+
+	/***
+	  * Same as `remove`, for many tickers and mods at once.
+	  * @param configs - The (ticker, mod, hooks) to remove
+	  */
+	[[eosio::action]]
+	void removemany(const std::vector<ProxyConfig>& configs){
+		check(configs.size() > 0, "At least one configuration must be provided");
+		remove_configs(configs);
+	}
+
+	/***
+	  * Cleans up proxy state for a totem that nothing uses anymore: hook rows with no mods left,
+	  * and licenses for mods that aren't on any hook. `remove` already does this as it goes,
+	  * this is for anything left behind. Anyone can call this.
+	  * @param ticker - The totem ticker to clean up
+	  * @param cursor - The license to continue from (exclusive), or null to start from the beginning
+	  * @param limit - The max number of licenses to check in this call
+	  * @return The cursor to continue from, or null when there's nothing left to check
+	  */
+	[[eosio::action]]
+	std::optional<name> gc(const symbol_code& ticker, const std::optional<name>& cursor, const uint32_t& limit){
+		// anyone can call this, so it doesn't spend the contract's RAM moving legacy rows over
+		proxy_table proxies(get_self(), get_self().value);
+		check(proxies.find(ticker.raw()) == proxies.end(), "This totem ticker must be migrated first");
+
+		std::set<name> subscribed;
+		subscribers_table subscribers(get_self(), ticker.raw());
+		auto sub = subscribers.begin();
+		while(sub != subscribers.end()){
+			if(sub->mods.empty()){
+				sub = subscribers.erase(sub);
+			} else {
+				subscribed.insert(sub->mods.begin(), sub->mods.end());
+				++sub;
+			}
 		}
 
-        proxy_table proxies(get_self(), get_self().value);
-        auto it = proxies.find(ticker.raw());
-
-        if(it == proxies.end()){
-            proxies.emplace(get_self(), [&](auto& row) {
-                row.ticker = ticker;
-                row.transfer = {};
-                row.mint = {};
-                row.burn = {};
-                row.open = {};
-                row.close = {};
-                row.created = {};
-
-                for(const auto& hook : hooks){
-                    add_mod_to_row(row, hook, mod);
-                }
-            });
-        } else {
-            proxies.modify(it, get_self(), [&](auto& row) {
-                for(const auto& hook : hooks){
-                    add_mod_to_row(row, hook, mod);
-                }
-            });
-        }
-    }
+		totems::license_table licenses(get_self(), ticker.raw());
+		auto it = cursor.has_value()
+			? licenses.upper_bound(cursor.value().value)
+			: licenses.begin();
+
+		name last;
+		uint32_t count = 0;
+		while(it != licenses.end() && count < limit){
+			last = it->mod;
+			if(subscribed.count(it->mod)){
+				++it;
+			} else {
+				it = licenses.erase(it);
+			}
+			count++;
+		}
+
+		if(it == licenses.end()){
+			return std::nullopt;
+		}
+		return last;
+	}
 
+	/***
+	  * Pays out the fees owed to each recipient in one transfer per recipient.
+	  * Anyone can call this, funds only ever go to whoever they are owed to.
+	  * @param recipients - The sellers to settle, ones with nothing owed are skipped
+	  */
 	[[eosio::action]]
-	void remove(const symbol_code& ticker, const name& hook, const name& mod){
-		require_auth(totems::get_totem_creator(ticker));
+	void settle(const std::vector<name>& recipients){
+		shared::settle_fees(get_self(), recipients);
+	}
+
+	/***
+	  * Converts all buffered $EOS to $A in one transfer. Anyone can call this.
+	  */
+	[[eosio::action]]
+	void sweep(){
+		shared::sweep_eos(get_self());
+	}
+
+	/***
+	  * Moves legacy `proxies` rows (all hooks in one row) into per-hook `subscribers` rows.
+	  * Until this has emptied `proxies`, notifications for hooks without a `subscribers` row also read the
+	  * legacy row, and configuring a ticker moves it over. Once it's empty this records that, and
+	  * notifications only ever read `subscribers`. Call it once even on a fresh deployment.
+	  * @param limit - The max number of legacy rows to migrate in this call
+	  */
+	[[eosio::action]]
+	void migrate(const uint32_t& limit){
+		require_auth(get_self());
 
 		proxy_table proxies(get_self(), get_self().value);
-		auto it = proxies.find(ticker.raw());
-		check(it != proxies.end(), "No proxy configuration for this totem ticker");
+		auto it = proxies.begin();
+		uint32_t count = 0;
+		while(it != proxies.end() && count < limit){
+			it = migrate_row(proxies, it);
+			count++;
+		}
 
-		proxies.modify(it, get_self(), [&](auto& row) {
-			remove_mod_from_row(row, hook, mod);
-		});
+		if(it == proxies.end()){
+			migration_table migration(get_self(), get_self().value);
+			if(migration.find(0) == migration.end()){
+				migration.emplace(get_self(), [&](auto& row){
+					row.done = true;
+				});
+			}
+		}
 	}
 
 	[[eosio::on_notify(TOTEMS_TRANSFER_NOTIFY)]]
@@ -103,56 +188,32 @@ CONTRACT proxy : public contract {
 			return;
 		}
 
-		proxy_table proxies(get_self(), get_self().value);
-		auto it = proxies.find(quantity.symbol.code().raw());
-		if(it != proxies.end()){
-			notify_mods(it->transfer);
-		}
+		notify_hook(quantity.symbol.code(), "transfer"_n);
 	}
 
 	[[eosio::on_notify(TOTEMS_MINT_NOTIFY)]]
 	void on_mint(const name& mod, const name& minter, const asset& quantity, const asset& payment, const std::string& memo){
-		proxy_table proxies(get_self(), get_self().value);
-        auto it = proxies.find(quantity.symbol.code().raw());
-        if(it != proxies.end()){
-            notify_mods(it->mint);
-        }
+		notify_hook(quantity.symbol.code(), "mint"_n);
 	}
 
 	[[eosio::on_notify(TOTEMS_BURN_NOTIFY)]]
 	void on_burn(const name& owner, const asset& quantity, const string& memo){
-		proxy_table proxies(get_self(), get_self().value);
-        auto it = proxies.find(quantity.symbol.code().raw());
-        if(it != proxies.end()){
-            notify_mods(it->burn);
-        }
+		notify_hook(quantity.symbol.code(), "burn"_n);
 	}
 
 	[[eosio::on_notify(TOTEMS_OPEN_NOTIFY)]]
 	void on_open(const name& owner, const symbol& ticker, const name& ram_payer){
-		proxy_table proxies(get_self(), get_self().value);
-		auto it = proxies.find(ticker.code().raw());
-		if(it != proxies.end()){
-			notify_mods(it->open);
-		}
+		notify_hook(ticker.code(), "open"_n);
 	}
 
 	[[eosio::on_notify(TOTEMS_CLOSE_NOTIFY)]]
 	void on_close(const name& owner, const symbol& ticker){
-		proxy_table proxies(get_self(), get_self().value);
-		auto it = proxies.find(ticker.code().raw());
-		if(it != proxies.end()){
-			notify_mods(it->close);
-		}
+		notify_hook(ticker.code(), "close"_n);
 	}
 
 	[[eosio::on_notify(TOTEMS_CREATED_NOTIFY)]]
 	void on_created(const name& creator, const symbol& ticker){
-		proxy_table proxies(get_self(), get_self().value);
-		auto it = proxies.find(ticker.code().raw());
-		if(it != proxies.end()){
-			notify_mods(it->created);
-		}
+		notify_hook(ticker.code(), "created"_n);
 	}
 
 	[[eosio::on_notify("eosio.token::transfer")]]
@@ -161,15 +222,208 @@ CONTRACT proxy : public contract {
 	}
 
 private:
-	void add_mod_to_row(Proxy& row, const name& hook, const name& mod){
-        if(hook == "transfer"_n) add_unique(row.transfer, mod);
-        else if(hook == "mint"_n) add_unique(row.mint, mod);
-        else if(hook == "burn"_n) add_unique(row.burn, mod);
-        else if(hook == "open"_n) add_unique(row.open, mod);
-        else if(hook == "close"_n) add_unique(row.close, mod);
-        else if(hook == "created"_n) add_unique(row.created, mod);
-        else check(false, "Invalid hook name");
-    }
+	// (ticker, hook) -> mods
+	typedef std::map<std::pair<symbol_code, name>, std::vector<name>> hook_changes;
+
+	void require_creators(const std::vector<ProxyConfig>& configs){
+		std::set<symbol_code> authorized;
+		for(const auto& config : configs){
+			if(authorized.insert(config.ticker).second){
+				require_auth(totems::get_totem_creator(config.ticker));
+			}
+		}
+	}
+
+	void add_configs(const std::vector<ProxyConfig>& configs){
+		require_creators(configs);
+
+		hook_changes additions;
+		std::map<name, uint64_t> fees;
+		uint64_t total_fees = 0;
+		for(const auto& config : configs){
+			check(config.hooks.size() > 0, "At least one hook must be provided");
+			migrate_ticker(config.ticker);
+
+			auto& _mod = totems::get_mod_view(config.mod);
+			check(_mod.exists(), "Mod is not published in market");
+			for(const auto& hook : config.hooks){
+				check(_mod.has_hook(hook), "Mod does not support required hook: " + hook.to_string());
+				add_unique(additions[{config.ticker, hook}], config.mod);
+			}
+
+			auto price = _mod.price();
+			if(price > 0){
+				fees[_mod.seller()] += price;
+				total_fees += price;
+			}
+
+			add_license(config.ticker, config.mod);
+		}
+
+		if(total_fees > 0){
+			// fees are paid out in batches with `settle`
+			shared::ensure_tokens_available(total_fees, get_self());
+			std::vector<shared::FeeDisbursement> disbursements;
+			for(const auto& [seller, amount] : fees){
+				disbursements.push_back(shared::FeeDisbursement{
+					.recipient = seller,
+					.amount = amount
+				});
+			}
+			shared::accrue_fees(get_self(), disbursements);
+		}
+
+		for(const auto& [key, mods] : additions){
+			add_subscribers(key.first, key.second, mods);
+		}
+	}
+
+	void remove_configs(const std::vector<ProxyConfig>& configs){
+		require_creators(configs);
+
+		hook_changes removals;
+		std::set<std::pair<symbol_code, name>> removed;
+		for(const auto& config : configs){
+			migrate_ticker(config.ticker);
+			subscribers_table subscribers(get_self(), config.ticker.raw());
+			check(subscribers.begin() != subscribers.end(), "No proxy configuration for this totem ticker");
+
+			for(const auto& hook : config.hooks){
+				check(is_valid_hook(hook), "Invalid hook name");
+				add_unique(removals[{config.ticker, hook}], config.mod);
+			}
+			removed.insert({config.ticker, config.mod});
+		}
+
+		for(const auto& [key, mods] : removals){
+			subscribers_table subscribers(get_self(), key.first.raw());
+			auto it = subscribers.find(key.second.value);
+			// nothing on this hook, same as removing a mod that isn't on it
+			if(it == subscribers.end()) continue;
+
+			auto remaining = it->mods;
+			for(const auto& mod : mods){
+				remove_mod_from_vector(remaining, mod);
+			}
+
+			// free the RAM for hooks that have nothing left on them
+			if(remaining.empty()){
+				subscribers.erase(it);
+			} else {
+				subscribers.modify(it, get_self(), [&](auto& row) {
+					row.mods = remaining;
+				});
+			}
+		}
+
+		// a mod that isn't on any hook anymore doesn't need its license
+		for(const auto& [ticker, mod] : removed){
+			if(!is_subscribed(ticker, mod)){
+				totems::license_table licenses(get_self(), ticker.raw());
+				auto it = licenses.find(mod.value);
+				if(it != licenses.end()){
+					licenses.erase(it);
+				}
+			}
+		}
+	}
+
+	// Whether the mod is on any hook for this totem
+	bool is_subscribed(const symbol_code& ticker, const name& mod){
+		subscribers_table subscribers(get_self(), ticker.raw());
+		for(const auto& row : subscribers){
+			if(std::find(row.mods.begin(), row.mods.end(), mod) != row.mods.end()){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void add_license(const symbol_code& ticker, const name& mod){
+		totems::license_table licenses(get_self(), ticker.raw());
+		auto it = licenses.find(mod.value);
+		if(it == licenses.end()){
+			licenses.emplace(get_self(), [&](auto& row){
+				row.mod = mod;
+			});
+		}
+	}
+
+	void add_subscribers(const symbol_code& ticker, const name& hook, const std::vector<name>& mods){
+		check(is_valid_hook(hook), "Invalid hook name");
+
+		subscribers_table subscribers(get_self(), ticker.raw());
+		auto it = subscribers.find(hook.value);
+		if(it == subscribers.end()){
+			subscribers.emplace(get_self(), [&](auto& row) {
+				row.hook = hook;
+				row.mods = mods;
+			});
+		} else {
+			auto merged = it->mods;
+			for(const auto& mod : mods){
+				add_unique(merged, mod);
+			}
+			if(merged.size() != it->mods.size()){
+				subscribers.modify(it, get_self(), [&](auto& row) {
+					row.mods = merged;
+				});
+			}
+		}
+	}
+
+	bool is_valid_hook(const name& hook){
+		return std::find(shared::VALID_HOOKS.begin(), shared::VALID_HOOKS.end(), hook) != shared::VALID_HOOKS.end();
+	}
+
+	void migrate_hook(const symbol_code& ticker, const name& hook, const std::vector<name>& mods){
+		if(mods.empty()) return;
+		add_subscribers(ticker, hook, mods);
+	}
+
+	proxy_table::const_iterator migrate_row(proxy_table& proxies, proxy_table::const_iterator it){
+		migrate_hook(it->ticker, "transfer"_n, it->transfer);
+		migrate_hook(it->ticker, "mint"_n, it->mint);
+		migrate_hook(it->ticker, "burn"_n, it->burn);
+		migrate_hook(it->ticker, "open"_n, it->open);
+		migrate_hook(it->ticker, "close"_n, it->close);
+		migrate_hook(it->ticker, "created"_n, it->created);
+		return proxies.erase(it);
+	}
+
+	// Moves the ticker's legacy row (if it still has one) into `subscribers`
+	void migrate_ticker(const symbol_code& ticker){
+		proxy_table proxies(get_self(), get_self().value);
+		auto it = proxies.find(ticker.raw());
+		if(it != proxies.end()){
+			migrate_row(proxies, it);
+		}
+	}
+
+	// Only reads, so a notification never writes RAM. A ticker with a `subscribers` row for the hook is one lookup,
+	// the legacy row is only read for hooks without one, until `migrate` has finished.
+	void notify_hook(const symbol_code& ticker, const name& hook){
+		subscribers_table subscribers(get_self(), ticker.raw());
+		auto it = subscribers.find(hook.value);
+		if(it != subscribers.end()){
+			notify_mods(it->mods);
+			return;
+		}
+
+		migration_table migration(get_self(), get_self().value);
+		if(migration.find(0) != migration.end()) return;
+
+		proxy_table proxies(get_self(), get_self().value);
+		auto legacy = proxies.find(ticker.raw());
+		if(legacy == proxies.end()) return;
+
+		if(hook == "transfer"_n) notify_mods(legacy->transfer);
+		else if(hook == "mint"_n) notify_mods(legacy->mint);
+		else if(hook == "burn"_n) notify_mods(legacy->burn);
+		else if(hook == "open"_n) notify_mods(legacy->open);
+		else if(hook == "close"_n) notify_mods(legacy->close);
+		else if(hook == "created"_n) notify_mods(legacy->created);
+	}
 
     void add_unique(std::vector<name>& vec, const name& mod){
 		if(std::find(vec.begin(), vec.end(), mod) == vec.end()){
@@ -178,16 +432,6 @@ private:
 	}
 
 
-	void remove_mod_from_row(Proxy& row, const name& hook, const name& mod){
-		if(hook == "transfer"_n) remove_mod_from_vector(row.transfer, mod);
-		else if(hook == "mint"_n) remove_mod_from_vector(row.mint, mod);
-		else if(hook == "burn"_n) remove_mod_from_vector(row.burn, mod);
-		else if(hook == "open"_n) remove_mod_from_vector(row.open, mod);
-		else if(hook == "close"_n) remove_mod_from_vector(row.close, mod);
-		else if(hook == "created"_n) remove_mod_from_vector(row.created, mod);
-		else check(false, "Invalid hook name");
-	}
-
 	void remove_mod_from_vector(std::vector<name>& vec, const name& mod){
 		auto it = std::find(vec.begin(), vec.end(), mod);
 		if(it != vec.end()){
@@ -20,22 +20,76 @@ namespace shared {
     	"close"_n
     };
 
-	void on_eos_transfer(const name& contract, const name& from, const name& to, const asset& quantity, const std::string& memo){
-	    if (to != contract || from == contract) {
-			return;
-		}
+	// Incoming $EOS is buffered and converted to $A in one transfer once this much has built up
+	// (or when `sweep_eos` is called). Set to 0 to convert every incoming transfer right away.
+	static const int64_t EOS_SWEEP_THRESHOLD = 100'0000;
 
-		if(from == "core.vaulta"_n){
+	// $EOS that has been received but not converted to $A yet
+	struct [[eosio::table]] PendingEos {
+		asset balance;
+
+		uint64_t primary_key() const { return 0; }
+	};
+
+	typedef eosio::multi_index<"pendingeos"_n, PendingEos> pending_eos_table;
+
+	int64_t get_pending_eos(const name& contract) {
+		pending_eos_table pending(contract, contract.value);
+		auto it = pending.find(0);
+		return it == pending.end() ? 0 : it->balance.amount;
+	}
+
+	// Converts all buffered $EOS to $A in a single transfer
+	void sweep_eos(const name& contract) {
+		pending_eos_table pending(contract, contract.value);
+		auto it = pending.find(0);
+		if(it == pending.end() || it->balance.amount == 0) {
 			return;
 		}
 
-		// always convert to $A so that contracts don't have to track $EOS balances
 		action(
 		   permission_level{contract, "active"_n},
 		   "eosio.token"_n,
 		   "transfer"_n,
-		   std::make_tuple( contract, "core.vaulta"_n, quantity, std::string("Totems A -> EOS") )
+		   std::make_tuple( contract, "core.vaulta"_n, it->balance, std::string("Totems A -> EOS") )
 		).send();
+
+		// keep the row around so the next deposit doesn't have to pay for it again
+		pending.modify(it, same_payer, [&](auto& row) {
+			row.balance.amount = 0;
+		});
+	}
+
+	void on_eos_transfer(const name& contract, const name& from, const name& to, const asset& quantity, const std::string& memo){
+	    if (to != contract || from == contract) {
+			return;
+		}
+
+		if(from == "core.vaulta"_n){
+			return;
+		}
+
+		check(quantity.symbol == EOS_SYMBOL, "Only EOS is accepted");
+
+		// always convert to $A so that contracts don't have to track $EOS balances,
+		// but batch it up so that small deposits don't each cost an inline transfer
+		pending_eos_table pending(contract, contract.value);
+		auto it = pending.find(0);
+		int64_t buffered = quantity.amount;
+		if(it == pending.end()) {
+			pending.emplace(contract, [&](auto& row) {
+				row.balance = quantity;
+			});
+		} else {
+			buffered += it->balance.amount;
+			pending.modify(it, same_payer, [&](auto& row) {
+				row.balance += quantity;
+			});
+		}
+
+		if(buffered >= EOS_SWEEP_THRESHOLD) {
+			sweep_eos(contract);
+		}
 	}
 
 
@@ -48,11 +102,40 @@ namespace shared {
 
     typedef eosio::multi_index<"accounts"_n, CoreBalance> core_balances_table;
 
+	// Fees that have been charged but not paid out yet
+	struct [[eosio::table]] FeeOwed {
+		name recipient;
+		uint64_t amount;
+
+		uint64_t primary_key() const { return recipient.value; }
+	};
+
+	typedef eosio::multi_index<"feesowed"_n, FeeOwed> fees_owed_table;
+
+	// Sum of all FeeOwed rows, so the $A already owed isn't spent twice
+	struct [[eosio::table]] FeesOwedTotal {
+		uint64_t amount;
+
+		uint64_t primary_key() const { return 0; }
+	};
+
+	typedef eosio::multi_index<"feesowedtot"_n, FeesOwedTotal> fees_owed_total_table;
+
+	uint64_t get_fees_owed(const name& contract) {
+		fees_owed_total_table totals(contract, contract.value);
+		auto it = totals.find(0);
+		return it == totals.end() ? 0 : it->amount;
+	}
+
+	// Buffered $EOS counts towards the balance, it gets converted before anything is paid out
 	void ensure_tokens_available(const uint64_t& fee, const name& account) {
         core_balances_table balances("core.vaulta"_n, account.value);
         auto balance = balances.find(VAULTA_SYMBOL.code().raw());
-        check(balance != balances.end(), "No balance found for fee payment");
-        check(balance->balance.amount >= fee, "Insufficient balance for fee payment");
+        auto pending = get_pending_eos(account);
+        check(balance != balances.end() || pending > 0, "No balance found for fee payment");
+
+        int64_t available = (balance == balances.end() ? 0 : balance->balance.amount) + pending;
+        check(available >= static_cast<int64_t>(get_fees_owed(account) + fee), "Insufficient balance for fee payment");
     }
 
     struct FeeDisbursement {
@@ -60,6 +143,45 @@ namespace shared {
 		uint64_t amount;
 	};
 
+	/***
+	  * Records fees as owed instead of paying them out inline.
+	  * They get paid in one transfer per recipient with `settle_fees`.
+	  * Make sure to `ensure_tokens_available` for the total first.
+	  */
+	void accrue_fees(const name& contract, const std::vector<FeeDisbursement>& disbursements) {
+		fees_owed_table owed(contract, contract.value);
+		uint64_t total = 0;
+		for (const auto& disbursement : disbursements) {
+			if(disbursement.amount == 0) continue;
+			total += disbursement.amount;
+
+			auto it = owed.find(disbursement.recipient.value);
+			if(it == owed.end()) {
+				owed.emplace(contract, [&](auto& row) {
+					row.recipient = disbursement.recipient;
+					row.amount = disbursement.amount;
+				});
+			} else {
+				owed.modify(it, same_payer, [&](auto& row) {
+					row.amount += disbursement.amount;
+				});
+			}
+		}
+
+		if(total == 0) return;
+		fees_owed_total_table totals(contract, contract.value);
+		auto it = totals.find(0);
+		if(it == totals.end()) {
+			totals.emplace(contract, [&](auto& row) {
+				row.amount = total;
+			});
+		} else {
+			totals.modify(it, same_payer, [&](auto& row) {
+				row.amount += total;
+			});
+		}
+	}
+
     void dispense_tokens(const name& contract, const std::vector<FeeDisbursement>& disbursements) {
         for (const auto& disbursement : disbursements) {
             if(disbursement.recipient == "eosio.fees"_n){
@@ -82,6 +204,37 @@ namespace shared {
 		}
 	}
 
+	/***
+	  * Pays out everything owed to the given recipients, one transfer each.
+	  * Recipients with nothing owed are skipped.
+	  */
+	void settle_fees(const name& contract, const std::vector<name>& recipients) {
+		fees_owed_table owed(contract, contract.value);
+		std::vector<FeeDisbursement> disbursements;
+		uint64_t total = 0;
+		for (const auto& recipient : recipients) {
+			auto it = owed.find(recipient.value);
+			if(it == owed.end()) continue;
+
+			disbursements.push_back(FeeDisbursement{
+				.recipient = it->recipient,
+				.amount = it->amount
+			});
+			total += it->amount;
+			owed.erase(it);
+		}
+
+		if(total == 0) return;
+		fees_owed_total_table totals(contract, contract.value);
+		totals.modify(totals.find(0), same_payer, [&](auto& row) {
+			row.amount -= total;
+		});
+
+		// inline actions run in order, so the $A from this lands before the payouts go out
+		sweep_eos(contract);
+		dispense_tokens(contract, disbursements);
+	}
+
 	struct [[eosio::table]] FeeConfig {
 		uint64_t amount;
 
@@ -79,11 +79,11 @@ private:
         if (config != configs.end()) {
             auto balance = totems::get_balance(account, quantity.symbol);
             if (config->max_holdings_percent > 0) {
-                auto totem = totems::get_totem(quantity.symbol.code());
-                check(totem.has_value(), "Totem does not exist");
+                auto& totem = totems::get_totem_view(quantity.symbol.code());
+                check(totem.exists(), "Totem does not exist");
                 int64_t max_holdings =
                     static_cast<int64_t>(
-                        ( (__int128) totem->max_supply.amount * config->max_holdings_percent ) / 100
+                        ( (__int128) totem.max_supply().amount * config->max_holdings_percent ) / 100
                     );
                 check(balance.amount <= max_holdings, "No whales allowed.");
             }
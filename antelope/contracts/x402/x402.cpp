@@ -3,6 +3,7 @@
 #include <eosio/system.hpp>
 
 #include "../library/totems.hpp"
+#include "../library/open_quota.hpp"
 using namespace eosio;
 
 CONTRACT x402 : public contract {
@@ -18,26 +19,97 @@ CONTRACT x402 : public contract {
         time_point_sec  expires;
 
         uint64_t primary_key() const { return id; }
+        // only used by the legacy `intents` table
         checksum256 by_hash() const { return request_hash; }
         uint128_t by_owner_id() const {
             return (uint128_t(owner.value) << 64) | id;
         }
+        uint128_t by_consumer_id() const {
+            return (uint128_t(consumer.value) << 64) | id;
+        }
+        uint64_t by_expiry() const { return expires.sec_since_epoch(); }
     };
 
+    // The highest id that has been removed while it was the newest row, so it's never handed out again (see `next_id`).
+    // Used to be a counter rewritten on every authorize, existing rows carry over as is.
     struct [[eosio::table]] ID {
 		uint64_t id;
 		uint64_t primary_key() const { return 0; }
 	};
 
+    // Intents are never looked up by hash, so v2 drops the 32 byte `byhash` index (see `migrate`)
+    typedef eosio::multi_index<
+        "intentsv2"_n,
+        Intent,
+        indexed_by<"byowner"_n, const_mem_fun<Intent, uint128_t, &Intent::by_owner_id>>,
+        indexed_by<"byexpiry"_n, const_mem_fun<Intent, uint64_t, &Intent::by_expiry>>,
+        indexed_by<"byconsumer"_n, const_mem_fun<Intent, uint128_t, &Intent::by_consumer_id>>
+    > intents_table;
+    // Exactly the deployed layout, its rows never had a `byexpiry` entry. `sweep` only walks `intentsv2`,
+    // where every row gets one on the way in (including the ones `migrate` moves over).
     typedef eosio::multi_index<
         "intents"_n,
         Intent,
         indexed_by<"byhash"_n, const_mem_fun<Intent, checksum256, &Intent::by_hash>>,
         indexed_by<"byowner"_n, const_mem_fun<Intent, uint128_t, &Intent::by_owner_id>>
-    > intents_table;
-    typedef eosio::multi_index<"accounts"_n, totems::Balance> balances_table;
-    typedef eosio::multi_index<"lockedbals"_n, totems::Balance> locked_balances_table;
+    > legacy_intents_table;
+
+    // Spendable and locked totems live in one row, so moving between them is a single modify
+    struct [[eosio::table]] EscrowBalance {
+        asset available;
+        asset locked;
+
+        uint64_t primary_key() const { return available.symbol.code().raw(); }
+    };
+
+    typedef eosio::multi_index<"balances"_n, EscrowBalance> balances_table;
+    // Legacy split balances, folded into `balances` by `migratebals`
+    typedef eosio::multi_index<"accounts"_n, totems::Balance> legacy_balances_table;
+    typedef eosio::multi_index<"lockedbals"_n, totems::Balance> legacy_locked_table;
     typedef eosio::multi_index<"ids"_n, ID> ids_table;
+    typedef eosio::multi_index<"chanids"_n, ID> channel_ids_table;
+
+    // Status bits returned by `verify`, an intent is good to serve when all of them are set
+    static constexpr uint8_t INTENT_EXISTS = 1;
+    static constexpr uint8_t INTENT_UNEXPIRED = 2;
+    static constexpr uint8_t INTENT_HASH_MATCH = 4;
+    static constexpr uint8_t INTENT_CONSUMER_MATCH = 8;
+    static constexpr uint8_t INTENT_VALID = INTENT_EXISTS | INTENT_UNEXPIRED | INTENT_HASH_MATCH | INTENT_CONSUMER_MATCH;
+
+    struct IntentRequest {
+        name            consumer;
+        asset           price;
+        checksum256     request_hash;
+        uint32_t        expires_sec;
+    };
+
+    // A budget locked once by the owner, paid out to the consumer with off-chain signed vouchers
+    struct [[eosio::table]] Channel {
+        uint64_t        id;
+        name            owner;
+        name            consumer;
+        asset           budget;   // locked when the channel was opened
+        asset           settled;  // already paid out to the consumer
+        public_key      signer;   // signs the vouchers, doesn't have to be one of the owner's keys
+        time_point_sec  expires;
+
+        uint64_t primary_key() const { return id; }
+        uint128_t by_owner_id() const {
+            return (uint128_t(owner.value) << 64) | id;
+        }
+    };
+
+    typedef eosio::multi_index<
+        "channels"_n,
+        Channel,
+        indexed_by<"byowner"_n, const_mem_fun<Channel, uint128_t, &Channel::by_owner_id>>
+    > channels_table;
+
+    // The total the owner has agreed to pay so far, vouchers replace each other instead of adding up
+    struct Voucher {
+        asset     cumulative;
+        signature sig;
+    };
 
 
 
@@ -50,65 +122,34 @@ CONTRACT x402 : public contract {
         const checksum256& request_hash,
         uint32_t expires_sec
     ) {
-        require_auth(owner);
-
-        balances_table balances(get_self(), owner.value);
-        auto bal = balances.find(price.symbol.code().raw());
-        check(bal != balances.end(), "No balance for this totem");
-        check(bal->balance >= price, "Insufficient funds to authorize intent");
-
-        balances.modify(bal, same_payer, [&](auto& b){
-			b.balance -= price;
-		});
-
-		locked_balances_table locked_bals(get_self(), owner.value);
-		auto locked_it = locked_bals.find(price.symbol.code().raw());
-		if(locked_it == locked_bals.end()){
-			locked_bals.emplace(owner, [&](auto& lb){
-				lb.balance = price;
-			});
-		} else {
-			locked_bals.modify(locked_it, same_payer, [&](auto& lb){
-				lb.balance += price;
-			});
-		}
-
-        intents_table intents(get_self(), get_self().value);
-        Intent intent{
-            .id = get_next_id(),
-            .owner = owner,
-            .consumer = consumer,
-            .price = price,
-            .request_hash = request_hash,
-            .expires = time_point_sec(current_time_point()) + expires_sec
-        };
-
-        intents.emplace(owner, [&](auto& row){
-            row = intent;
-        });
+        return authorize_intents(owner, {{ consumer, price, request_hash, expires_sec }})[0];
+    }
 
-		return intent;
+    /***
+      * Same as `authorize`, for many intents at once.
+      * The total per totem is checked against the balance and locked in a single move.
+      * @param owner - The account approving the intents
+      * @param requests - The consumer, price, request hash and expiry of each intent
+      * @return The created intents, in the same order
+      */
+    [[eosio::action]]
+    std::vector<Intent> authmany(const name& owner, const std::vector<IntentRequest>& requests){
+        check(requests.size() > 0, "At least one intent must be provided");
+        return authorize_intents(owner, requests);
     }
 
 	[[eosio::action]]
     void revoke(const uint64_t& id){
         intents_table intents(get_self(), get_self().value);
-		auto it = intents.find(id);
+		auto it = find_intent(intents, id);
 		check(it != intents.end(), "Intent not found");
 		require_auth(it->owner);
 
-		// no need to confirm existence for locked/unlocked balances, they must exist if the intent exists
-		locked_balances_table locked_bals(get_self(), it->owner.value);
-		locked_bals.modify(locked_bals.find(it->price.symbol.code().raw()), same_payer, [&](auto& b){
-			b.balance -= it->price;
-		});
-
-		balances_table balances(get_self(), it->owner.value);
-		balances.modify(balances.find(it->price.symbol.code().raw()), same_payer, [&](auto& b){
-			b.balance += it->price;
-		});
+		amounts_by_account revoked{{{it->owner, it->price.symbol}, it->price.amount}};
+		release_balances(revoked, revoked);
 
 		intents.erase(it);
+		retire_id<ids_table, intents_table>(id);
     }
 
     [[eosio::action]]
@@ -116,47 +157,190 @@ CONTRACT x402 : public contract {
         const uint64_t& id,
         const checksum256& request_hash
     ) {
-        intents_table intents(get_self(), get_self().value);
-        auto it = intents.find(id);
-        check(it != intents.end(), "Invalid or already used intent");
+        return consume_intents({ id }, { request_hash })[0];
+    }
 
-        require_auth(it->consumer);
+    /***
+      * Same as `consume`, for many intents at once.
+      * Expired intents are refunded to their owners, and everything else is paid out in a single
+      * transfer per consumer and totem. Each owner's balances are only modified once.
+      * @param ids - The intents to consume
+      * @param request_hashes - The request hash for each intent, in the same order
+      */
+    [[eosio::action]]
+    void consumemany(
+        const std::vector<uint64_t>& ids,
+        const std::vector<checksum256>& request_hashes
+    ) {
+        check(ids.size() > 0, "At least one intent must be provided");
+        check(ids.size() == request_hashes.size(), "Every intent needs a request hash");
+        consume_intents(ids, request_hashes);
+    }
+
+
+
+
+
+    /***
+      * Opens a payment channel, locking the whole budget once.
+      * The owner then signs vouchers off-chain for the running total they owe, and the consumer only
+      * submits the latest one with `settle` or `closechannel`.
+      * @param owner - The account paying through the channel
+      * @param consumer - The account being paid
+      * @param budget - The most that can ever be paid out through this channel
+      * @param signer - The key that signs vouchers for this channel
+      * @param expires_sec - How many seconds until the owner can reclaim what's left
+      * @return The new channel
+      */
+    [[eosio::action]]
+    Channel openchannel(
+        const name& owner,
+        const name& consumer,
+        const asset& budget,
+        const public_key& signer,
+        uint32_t expires_sec
+    ) {
+        require_auth(owner);
+        check(is_account(consumer), "Consumer account does not exist.");
+        check(budget.is_valid() && budget.amount > 0, "Budget must be positive");
+        lock_balance(owner, budget, "Insufficient funds to open channel");
+
+        channels_table channels(get_self(), get_self().value);
+        Channel channel{
+            .id = next_id<channel_ids_table>(channels),
+            .owner = owner,
+            .consumer = consumer,
+            .budget = budget,
+            .settled = asset{0, budget.symbol},
+            .signer = signer,
+            .expires = time_point_sec(current_time_point()) + expires_sec
+        };
+
+        channels.emplace(owner, [&](auto& row){
+            row = channel;
+        });
 
-        check(it->request_hash == request_hash, "Request hash does not match.");
+        return channel;
+    }
 
-        locked_balances_table locked_bals(get_self(), it->owner.value);
-        auto bal = locked_bals.find(it->price.symbol.code().raw());
-        check(bal->balance >= it->price, "Insufficient funds");
+    /***
+      * Pays the consumer the difference between a voucher and what has already been settled.
+      * The channel stays open for newer vouchers.
+      * @param id - The channel to settle
+      * @param voucher - The latest voucher signed by the channel's signer
+      */
+    [[eosio::action]]
+    void settle(const uint64_t& id, const Voucher& voucher){
+        channels_table channels(get_self(), get_self().value);
+        auto it = channels.find(id);
+        check(it != channels.end(), "Channel not found");
+        require_auth(it->consumer);
+        check(it->expires >= current_time_point(), "Channel has expired");
 
-        locked_bals.modify(bal, same_payer, [&](auto& b){
-            b.balance -= it->price;
+        int64_t amount = redeem_voucher(*it, voucher);
+        channels.modify(it, same_payer, [&](auto& row){
+            row.settled = voucher.cumulative;
         });
 
-        if(it->expires < current_time_point()){
-            balances_table balances(get_self(), it->owner.value);
-            // there's no way to close the balance, no need to check existence
-            balances.modify(balances.find(it->price.symbol.code().raw()), same_payer, [&](auto& b){
-            	b.balance += it->price;
-			});
+        release_balances({{{it->owner, it->budget.symbol}, amount}}, {});
+        credit_earnings({{{it->consumer, it->budget.symbol}, amount}});
+    }
 
-			intents.erase(it);
-			return false;
+    /***
+      * Closes a channel from the consumer's side, optionally settling a last voucher first.
+      * Whatever is left of the budget goes back to the owner's balance.
+      * @param id - The channel to close
+      * @param voucher - (optional) The latest voucher, if it hasn't been settled yet
+      */
+    [[eosio::action]]
+    void closechannel(const uint64_t& id, const std::optional<Voucher>& voucher){
+        channels_table channels(get_self(), get_self().value);
+        auto it = channels.find(id);
+        check(it != channels.end(), "Channel not found");
+        require_auth(it->consumer);
+
+        int64_t amount = 0;
+        if(voucher.has_value()){
+            check(it->expires >= current_time_point(), "Channel has expired");
+            amount = redeem_voucher(*it, voucher.value());
         }
 
-        totems::transfer(
-            get_self(),
-            it->consumer,
-            it->price,
-            "x402 payment"
-        );
+        release_channel(*it, it->settled.amount + amount);
+        if(amount > 0){
+            credit_earnings({{{it->consumer, it->budget.symbol}, amount}});
+        }
+        channels.erase(it);
+        retire_id<channel_ids_table, channels_table>(id);
+    }
 
-        intents.erase(it);
-        return true;
+    /***
+      * Lets the owner take back the unsettled budget of an expired channel.
+      * @param id - The channel to reclaim
+      */
+    [[eosio::action]]
+    void reclaim(const uint64_t& id){
+        channels_table channels(get_self(), get_self().value);
+        auto it = channels.find(id);
+        check(it != channels.end(), "Channel not found");
+        require_auth(it->owner);
+        check(it->expires < current_time_point(), "Channel has not expired yet");
+
+        release_channel(*it, it->settled.amount);
+        channels.erase(it);
+        retire_id<channel_ids_table, channels_table>(id);
     }
 
+    /***
+      * Removes expired intents and returns their totems to the owners' balances, oldest first.
+      * Anyone can call this, so abandoned intents don't keep funds (and RAM) locked forever.
+      * Each owner's balances are only modified once per call. Legacy intents are only seen once `migrate` has moved them.
+      * @param limit - The max number of intents to remove in this call
+      * @return The number of intents removed
+      */
+    [[eosio::action]]
+    uint32_t sweep(const uint32_t& limit) {
+        intents_table intents(get_self(), get_self().value);
+        auto idx = intents.get_index<"byexpiry"_n>();
+        auto now = time_point_sec(current_time_point());
 
+        amounts_by_account expired;
+        uint64_t highest = 0;
+        uint32_t count = 0;
+        auto itr = idx.begin();
+        while(itr != idx.end() && itr->expires < now && count < limit){
+            expired[{itr->owner, itr->price.symbol}] += itr->price.amount;
+            highest = std::max(highest, itr->id);
+            itr = idx.erase(itr);
+            count++;
+        }
 
+        release_balances(expired, expired);
+        if(count > 0){
+            retire_id<ids_table, intents_table>(highest);
+        }
+        return count;
+    }
 
+    /***
+      * Moves intents from the legacy `intents` table into `intentsv2`, keeping their ids.
+      * Consuming or revoking a legacy intent moves it over on the way, but `sweep` only reads the new table,
+      * so run this until `intents` is empty after upgrading. The contract pays for the migrated rows,
+      * the owners get their RAM back.
+      * @param limit - The max number of intents to migrate in this call
+      */
+    [[eosio::action]]
+    void migrate(const uint32_t& limit){
+        require_auth(get_self());
+
+        legacy_intents_table legacy(get_self(), get_self().value);
+        intents_table intents(get_self(), get_self().value);
+        auto it = legacy.begin();
+        uint32_t count = 0;
+        while(it != legacy.end() && count < limit){
+            it = migrate_intent(legacy, intents, it).first;
+            count++;
+        }
+    }
 
 	[[eosio::action]]
 	void transfer(const name& from, const name& to, const asset& quantity, const std::string& memo){
@@ -169,12 +353,12 @@ CONTRACT x402 : public contract {
 		check(quantity.amount > 0, "Cannot withdraw negative amount.");
 
 		balances_table balances(get_self(), from.value);
-		auto it = balances.find(quantity.symbol.code().raw());
+		auto it = find_balance(balances, from, quantity.symbol);
 		check(it != balances.end(), "You have no balance for this totem.");
-		check(it->balance.amount >= quantity.amount, "Insufficient balance.");
+		check(it->available.amount >= quantity.amount, "Insufficient balance.");
 
 		balances.modify(it, same_payer, [&](auto& row) {
-			row.balance -= quantity;
+			row.available -= quantity;
 		});
 
 		totems::transfer(
@@ -185,6 +369,30 @@ CONTRACT x402 : public contract {
 		);
 	}
 
+    /***
+      * Withdraws an account's whole spendable balance of a totem in a single transfer.
+      * Consumers are paid into their balance here, so this is how they collect their earnings.
+      * @param owner - The account withdrawing
+      * @param ticker - The totem to withdraw
+      */
+    [[eosio::action]]
+    void withdraw(const name& owner, const symbol& ticker){
+        totems::check_license(ticker.code(), get_self());
+        require_auth(owner);
+
+        balances_table balances(get_self(), owner.value);
+        auto it = find_balance(balances, owner, ticker);
+        check(it != balances.end(), "You have no balance for this totem.");
+        check(it->available.amount > 0, "Nothing to withdraw.");
+
+        auto quantity = it->available;
+        balances.modify(it, same_payer, [&](auto& row) {
+            row.available.amount = 0;
+        });
+
+        totems::transfer(get_self(), owner, quantity, "x402 withdrawal");
+    }
+
     [[eosio::action]]
     void open(const name& owner, const symbol& ticker) {
         totems::check_license(ticker.code(), get_self());
@@ -192,47 +400,143 @@ CONTRACT x402 : public contract {
         require_auth(owner);
 
         balances_table balances(get_self(), owner.value);
-        auto it = balances.find(ticker.code().raw());
+        auto it = find_balance(balances, owner, ticker);
         if (it == balances.end()) {
-			balances.emplace(owner, [&](auto& a) { a.balance = asset{0, ticker}; });
+			balances.emplace(owner, [&](auto& a) {
+				a.available = asset{0, ticker};
+				a.locked = asset{0, ticker};
+			});
 		}
     }
 
+    /***
+      * Closes an empty balance and gives back its RAM.
+      * Balances with anything locked can't be closed.
+      * @param owner - The account closing the balance
+      * @param ticker - The totem of the balance
+      */
+    [[eosio::action]]
+    void close(const name& owner, const symbol& ticker){
+        require_auth(owner);
+
+        balances_table balances(get_self(), owner.value);
+        auto it = find_balance(balances, owner, ticker);
+        check(it != balances.end(), "You have no balance for this totem.");
+        check(it->available.amount == 0 && it->locked.amount == 0, "Balance must be zero to close.");
+        balances.erase(it);
+        open_quota::release_open_quota(get_self(), owner, ticker.code());
+    }
+
+	/***
+	  * Sets how many balance rows this contract pays for when deposits open them.
+	  * Rows opened this way count towards the quota until they're closed, so it also caps the RAM they can cost.
+	  * @param max - The max number of contract-paid balance rows, 0 turns auto-opening off
+	  */
+	[[eosio::action]]
+	void setquota(const uint64_t& max){
+		require_auth(get_self());
+		open_quota::set_quota(get_self(), max);
+	}
+
+
+    /***
+      * Folds an owner's legacy `accounts` and `lockedbals` rows into combined `balances` rows.
+      * Every action that touches a balance folds its legacy rows on the way, this does all of an owner's at once.
+      * The owner pays for the new rows if they sign, otherwise the contract does.
+      * @param owner - The account whose balances get folded
+      */
+    [[eosio::action]]
+    void migratebals(const name& owner){
+        name payer = has_auth(owner) ? owner : get_self();
+        if(payer != owner) require_auth(get_self());
+
+        legacy_balances_table legacy(get_self(), owner.value);
+        legacy_locked_table legacy_locked(get_self(), owner.value);
+        balances_table balances(get_self(), owner.value);
+        check(legacy.begin() != legacy.end() || legacy_locked.begin() != legacy_locked.end(), "Nothing to migrate");
+
+        auto it = legacy.begin();
+        while(it != legacy.end()){
+            auto locked = legacy_locked.find(it->balance.symbol.code().raw());
+            if(locked == legacy_locked.end()){
+                fold_balance(balances, payer, it->balance, asset{0, it->balance.symbol});
+            } else {
+                fold_balance(balances, payer, it->balance, locked->balance);
+                legacy_locked.erase(locked);
+            }
+            it = legacy.erase(it);
+        }
+
+        // locked rows without a spendable row can't be created, but don't leave anything behind
+        auto locked = legacy_locked.begin();
+        while(locked != legacy_locked.end()){
+            fold_balance(balances, payer, asset{0, locked->balance.symbol}, locked->balance);
+            locked = legacy_locked.erase(locked);
+        }
+    }
+
     [[eosio::action, eosio::read_only]]
     std::optional<Intent> getintent(const uint64_t& id){
-    	intents_table intents(get_self(), get_self().value);
-	    auto it = intents.find(id);
-	    if(it != intents.end()){
-			return *it;
-		}
-		return std::nullopt;
+		return get_intent(id);
+    }
+
+    /***
+      * Checks a batch of intents for a gateway in one call, without consuming them.
+      * @param consumer - The account that should be paid
+      * @param ids - The intents to check
+      * @param request_hashes - The request hash for each intent, in the same order
+      * @return The status bits for each intent, in the same order (see INTENT_VALID)
+      */
+    [[eosio::action, eosio::read_only]]
+    std::vector<uint8_t> verify(
+        const name& consumer,
+        const std::vector<uint64_t>& ids,
+        const std::vector<checksum256>& request_hashes
+    ){
+        check(ids.size() == request_hashes.size(), "Every intent needs a request hash");
+
+        auto now = time_point_sec(current_time_point());
+        std::vector<uint8_t> statuses;
+        statuses.reserve(ids.size());
+        for(size_t i = 0; i < ids.size(); i++){
+            uint8_t status = 0;
+            auto it = get_intent(ids[i]);
+            if(it.has_value()){
+                status |= INTENT_EXISTS;
+                if(it->expires >= now) status |= INTENT_UNEXPIRED;
+                if(it->request_hash == request_hashes[i]) status |= INTENT_HASH_MATCH;
+                if(it->consumer == consumer) status |= INTENT_CONSUMER_MATCH;
+            }
+            statuses.push_back(status);
+        }
+        return statuses;
+    }
+
+    [[eosio::action, eosio::read_only]]
+    std::optional<Channel> getchannel(const uint64_t& id){
+        channels_table channels(get_self(), get_self().value);
+        auto it = channels.find(id);
+        if(it != channels.end()){
+            return *it;
+        }
+        return std::nullopt;
     }
 
     [[eosio::action, eosio::read_only]]
     bool isopen(const name& owner, const symbol& ticker){
-        balances_table balances(get_self(), owner.value);
-        auto it = balances.find(ticker.code().raw());
-        return it != balances.end();
+        return get_escrow_balance(owner, ticker).has_value();
     }
 
     [[eosio::action, eosio::read_only]]
     asset getbalance(const name& owner, const symbol& ticker){
-        balances_table balances(get_self(), owner.value);
-        auto it = balances.find(ticker.code().raw());
-        if(it != balances.end()){
-            return it->balance;
-        }
-        return asset{0, ticker};
+        auto balance = get_escrow_balance(owner, ticker);
+        return balance.has_value() ? balance->available : asset{0, ticker};
     }
 
     [[eosio::action, eosio::read_only]]
     asset getlockedbal(const name& owner, const symbol& ticker){
-        locked_balances_table locked_bals(get_self(), owner.value);
-		auto it = locked_bals.find(ticker.code().raw());
-		if(it != locked_bals.end()){
-			return it->balance;
-		}
-		return asset{0, ticker};
+        auto balance = get_escrow_balance(owner, ticker);
+        return balance.has_value() ? balance->locked : asset{0, ticker};
     }
 
 	struct MyIntentsResult {
@@ -272,6 +576,44 @@ CONTRACT x402 : public contract {
         return result;
     }
 
+    /***
+      * Pending intents addressed to a consumer, so API providers only scan their own intents.
+      * @param consumer - The account being paid
+      * @param limit - The max number of intents to return
+      * @param cursor - (optional) The cursor returned by the previous page
+      */
+    [[eosio::action, eosio::read_only]]
+    MyIntentsResult getpending(
+        const name& consumer,
+        const uint32_t& limit,
+        const std::optional<uint128_t>& cursor
+    ){
+        MyIntentsResult result;
+
+        intents_table intents(get_self(), get_self().value);
+        auto idx = intents.get_index<"byconsumer"_n>();
+
+        uint128_t base = uint128_t(consumer.value) << 64;
+
+        auto itr = cursor.has_value()
+            ? idx.upper_bound(cursor.value())
+            : idx.lower_bound(base);
+
+        uint32_t count = 0;
+        while (
+            itr != idx.end() &&
+            itr->consumer == consumer &&
+            count < limit
+        ){
+            result.intents.push_back(*itr);
+            result.cursor = itr->by_consumer_id(); // last emitted key
+            ++itr;
+            ++count;
+        }
+
+        return result;
+    }
+
 
     [[eosio::on_notify(TOTEMS_TRANSFER_NOTIFY)]]
     void on_transfer(const name& from, const name& to, const asset& quantity, const std::string& memo) {
@@ -282,27 +624,329 @@ CONTRACT x402 : public contract {
 
         if(to == get_self()){
             balances_table balances(get_self(), from.value);
-            auto it = balances.find(quantity.symbol.code().raw());
-            check(it != balances.end(), "You must open a balance first.");
-            balances.modify(it, same_payer, [&](auto& a) { a.balance += quantity; });
+            auto it = find_balance(balances, from, quantity.symbol);
+            if(it == balances.end()){
+                open_quota::use_open_quota(get_self(), from, quantity.symbol.code());
+                balances.emplace(get_self(), [&](auto& a) {
+                    a.available = quantity;
+                    a.locked = asset{0, quantity.symbol};
+                });
+            } else {
+                balances.modify(it, same_payer, [&](auto& a) { a.available += quantity; });
+            }
         }
     }
 
 private:
-	uint64_t get_next_id(){
-		ids_table ids(get_self(), get_self().value);
+	// (account, ticker) -> amount
+	typedef std::map<std::pair<name, symbol>, int64_t> amounts_by_account;
+
+	std::vector<Intent> authorize_intents(const name& owner, const std::vector<IntentRequest>& requests){
+		require_auth(owner);
+
+		// Summed as assets so that the addition is overflow checked
+		std::map<symbol, asset> totals;
+		for(const auto& request : requests){
+			check(request.price.is_valid() && request.price.amount > 0, "Price must be positive");
+			auto [total, _] = totals.emplace(request.price.symbol, asset{0, request.price.symbol});
+			total->second += request.price;
+		}
+		for(const auto& [sym, total] : totals){
+			lock_balance(owner, total, "Insufficient funds to authorize intent");
+		}
+
+		intents_table intents(get_self(), get_self().value);
+		auto now = time_point_sec(current_time_point());
+		uint64_t id = next_id<ids_table>(intents);
+		std::vector<Intent> created;
+		for(const auto& request : requests){
+			Intent intent{
+				.id = id++,
+				.owner = owner,
+				.consumer = request.consumer,
+				.price = request.price,
+				.request_hash = request.request_hash,
+				.expires = now + request.expires_sec
+			};
+
+			intents.emplace(owner, [&](auto& row){
+				row = intent;
+			});
+			created.push_back(intent);
+		}
+
+		return created;
+	}
+
+	// Consumes intents, returning whether each one was paid (true) or had expired and was refunded (false)
+	std::vector<bool> consume_intents(const std::vector<uint64_t>& ids, const std::vector<checksum256>& request_hashes){
+		intents_table intents(get_self(), get_self().value);
+
+		std::set<name> authorized;
+		uint64_t highest = 0;
+		amounts_by_account unlocks;
+		amounts_by_account refunds;
+		amounts_by_account payouts;
+		std::vector<bool> paid;
+		for(size_t i = 0; i < ids.size(); i++){
+			auto it = find_intent(intents, ids[i]);
+			check(it != intents.end(), "Invalid or already used intent");
+
+			if(authorized.insert(it->consumer).second){
+				require_auth(it->consumer);
+			}
+
+			check(it->request_hash == request_hashes[i], "Request hash does not match.");
+
+			unlocks[{it->owner, it->price.symbol}] += it->price.amount;
+			if(it->expires < current_time_point()){
+				refunds[{it->owner, it->price.symbol}] += it->price.amount;
+				paid.push_back(false);
+			} else {
+				payouts[{it->consumer, it->price.symbol}] += it->price.amount;
+				paid.push_back(true);
+			}
+
+			highest = std::max(highest, ids[i]);
+			intents.erase(it);
+		}
+
+		release_balances(unlocks, refunds);
+		retire_id<ids_table, intents_table>(highest);
+
+		credit_earnings(payouts);
+
+		return paid;
+	}
+
+	// Moves an amount from an owner's spendable balance into their locked balance
+	void lock_balance(const name& owner, const asset& quantity, const std::string& error){
+		balances_table balances(get_self(), owner.value);
+		auto bal = find_balance(balances, owner, quantity.symbol);
+		check(bal != balances.end(), "No balance for this totem");
+		check(bal->available >= quantity, error);
+
+		balances.modify(bal, same_payer, [&](auto& b){
+			b.available -= quantity;
+			b.locked += quantity;
+		});
+	}
+
+	// Read-only lookup across both layouts. A deposit can open a combined row before the legacy ones
+	// have been folded in, so the two are added up rather than one shadowing the other.
+	std::optional<EscrowBalance> get_escrow_balance(const name& owner, const symbol& ticker){
+		std::optional<EscrowBalance> result;
+		balances_table balances(get_self(), owner.value);
+		auto it = balances.find(ticker.code().raw());
+		if(it != balances.end()){
+			result = *it;
+		}
+
+		legacy_balances_table legacy(get_self(), owner.value);
+		legacy_locked_table legacy_locked(get_self(), owner.value);
+		auto legacy_it = legacy.find(ticker.code().raw());
+		auto locked_it = legacy_locked.find(ticker.code().raw());
+		if(legacy_it == legacy.end() && locked_it == legacy_locked.end()){
+			return result;
+		}
+
+		if(!result.has_value()){
+			result = EscrowBalance{ .available = asset{0, ticker}, .locked = asset{0, ticker} };
+		}
+		if(legacy_it != legacy.end()) result->available += legacy_it->balance;
+		if(locked_it != legacy_locked.end()) result->locked += locked_it->balance;
+		return result;
+	}
+
+	// Adds amounts to an owner's combined balance row, creating it if there isn't one yet
+	balances_table::const_iterator fold_balance(
+		balances_table& balances,
+		const name& payer,
+		const asset& available,
+		const asset& locked
+	){
+		auto it = balances.find(available.symbol.code().raw());
+		if(it == balances.end()){
+			return balances.emplace(payer, [&](auto& row){
+				row.available = available;
+				row.locked = locked;
+			});
+		}
+
+		balances.modify(it, same_payer, [&](auto& row){
+			row.available += available;
+			row.locked += locked;
+		});
+		return it;
+	}
+
+	// Finds an owner's combined balance row, folding their legacy `accounts` and `lockedbals` rows
+	// into it first if they haven't been migrated yet. The contract pays for a row created this way,
+	// since the owner isn't always the one signing (consumers, deposits, anyone sweeping).
+	balances_table::const_iterator find_balance(balances_table& balances, const name& owner, const symbol& ticker){
+		legacy_balances_table legacy(get_self(), owner.value);
+		legacy_locked_table legacy_locked(get_self(), owner.value);
+		auto legacy_it = legacy.find(ticker.code().raw());
+		auto locked_it = legacy_locked.find(ticker.code().raw());
+		if(legacy_it == legacy.end() && locked_it == legacy_locked.end()){
+			return balances.find(ticker.code().raw());
+		}
+
+		auto it = fold_balance(
+			balances,
+			get_self(),
+			legacy_it == legacy.end() ? asset{0, ticker} : legacy_it->balance,
+			locked_it == legacy_locked.end() ? asset{0, ticker} : locked_it->balance
+		);
+		if(legacy_it != legacy.end()) legacy.erase(legacy_it);
+		if(locked_it != legacy_locked.end()) legacy_locked.erase(locked_it);
+		return it;
+	}
+
+	// sha256 of the packed (domain, contract, channel id, cumulative), so a voucher can't be replayed against
+	// another channel or another deployment of this contract.
+	// Channel ids are never reused (see `next_id`), so that holds for channels that are already closed too.
+	checksum256 voucher_digest(const uint64_t& channel_id, const asset& cumulative){
+		auto data = pack(std::make_tuple("voucher"_n, get_self(), channel_id, cumulative));
+		return sha256(data.data(), data.size());
+	}
+
+	// Checks a voucher against the channel, returning how much more it pays out
+	int64_t redeem_voucher(const Channel& channel, const Voucher& voucher){
+		check(voucher.cumulative.symbol == channel.budget.symbol, "Voucher is for a different totem");
+		check(voucher.cumulative > channel.settled, "Voucher already settled");
+		check(voucher.cumulative <= channel.budget, "Voucher exceeds channel budget");
+		check(
+			recover_key(voucher_digest(channel.id, voucher.cumulative), voucher.sig) == channel.signer,
+			"Invalid voucher signature"
+		);
+		return voucher.cumulative.amount - channel.settled.amount;
+	}
+
+	// Unlocks the whole remaining budget, giving back whatever isn't paid out
+	void release_channel(const Channel& channel, const int64_t& paid){
+		int64_t unsettled = channel.budget.amount - channel.settled.amount;
+		int64_t refund = channel.budget.amount - paid;
+		release_balances(
+			{{{channel.owner, channel.budget.symbol}, unsettled}},
+			{{{channel.owner, channel.budget.symbol}, refund}}
+		);
+	}
+
+	// Ids are never handed out twice, so a gateway holding an old id can't see it point at a new row.
+	// New ids continue after the highest live row, and the id row only has to be written by `retire_id`,
+	// so creating rows never touches a shared counter.
+	template <typename IdTable, typename Table>
+	uint64_t next_id(const Table& table){
+		IdTable ids(get_self(), get_self().value);
+		auto it = ids.find(0);
+		uint64_t next = table.available_primary_key();
+		if(it != ids.end() && it->id >= next){
+			next = it->id + 1;
+		}
+		return next;
+	}
+
+	// Call after erasing rows with the highest id that was removed. Only writes when that was the newest row,
+	// since `available_primary_key` would hand its id out again.
+	template <typename IdTable, typename Table>
+	void retire_id(const uint64_t& removed){
+		// a fresh table, erasing doesn't lower an already computed `available_primary_key`
+		Table table(get_self(), get_self().value);
+		if(table.available_primary_key() > removed) return;
+
+		IdTable ids(get_self(), get_self().value);
 		auto it = ids.find(0);
-		uint64_t next_id = 0;
 		if(it == ids.end()){
-			ids.emplace(get_self(), [&](auto& id){
-				id.id = next_id;
+			ids.emplace(get_self(), [&](auto& row){
+				row.id = removed;
+			});
+		} else if(it->id < removed){
+			ids.modify(it, same_payer, [&](auto& row){
+				row.id = removed;
 			});
-		} else {
-			next_id = it->id + 1;
-			ids.modify(it, same_payer, [&](auto& id){
-				id.id = next_id;
+		}
+	}
+
+	// Moves a legacy intent into `intentsv2`, returning the next legacy row and the moved intent
+	std::pair<legacy_intents_table::const_iterator, intents_table::const_iterator> migrate_intent(
+		legacy_intents_table& legacy,
+		intents_table& intents,
+		legacy_intents_table::const_iterator it
+	){
+		auto moved = intents.emplace(get_self(), [&](auto& row){
+			row = *it;
+		});
+		return { legacy.erase(it), moved };
+	}
+
+	// Finds an intent, moving it over from the legacy table first if it hasn't been migrated yet.
+	// The old counter row already covers every legacy id, so `next_id` never needs to look at that table.
+	intents_table::const_iterator find_intent(intents_table& intents, const uint64_t& id){
+		auto it = intents.find(id);
+		if(it != intents.end()) return it;
+
+		legacy_intents_table legacy(get_self(), get_self().value);
+		auto legacy_it = legacy.find(id);
+		if(legacy_it == legacy.end()) return it;
+		return migrate_intent(legacy, intents, legacy_it).second;
+	}
+
+	// Read-only lookup across both layouts
+	std::optional<Intent> get_intent(const uint64_t& id){
+		intents_table intents(get_self(), get_self().value);
+		auto it = intents.find(id);
+		if(it != intents.end()){
+			return *it;
+		}
+
+		legacy_intents_table legacy(get_self(), get_self().value);
+		auto legacy_it = legacy.find(id);
+		if(legacy_it != legacy.end()){
+			return *legacy_it;
+		}
+		return std::nullopt;
+	}
+
+	// Pays consumers into their spendable balances instead of a totems transfer per payment,
+	// they collect with `withdraw`. Consumers have signed for the payment, so they pay for new rows.
+	void credit_earnings(const amounts_by_account& payouts){
+		for(const auto& [key, amount] : payouts){
+			balances_table balances(get_self(), key.first.value);
+			auto bal = find_balance(balances, key.first, key.second);
+			if(bal == balances.end()){
+				balances.emplace(key.first, [&](auto& b){
+					b.available = asset{amount, key.second};
+					b.locked = asset{0, key.second};
+				});
+			} else {
+				balances.modify(bal, same_payer, [&](auto& b){
+					b.available.amount += amount;
+				});
+			}
+		}
+	}
+
+	// Takes `unlocks` out of owners' locked balances and gives `refunds` back to their spendable balances,
+	// one modify per owner and ticker. Anything refunded must also be unlocked.
+	void release_balances(const amounts_by_account& unlocks, const amounts_by_account& refunds){
+		for(const auto& [key, amount] : unlocks){
+			// a fully settled channel has nothing left locked, and its owner may have closed the balance since
+			if(amount == 0) continue;
+
+			balances_table balances(get_self(), key.first.value);
+			auto bal = find_balance(balances, key.first, key.second);
+			check(bal != balances.end(), "No balance for this totem");
+			check(bal->locked.amount >= amount, "Insufficient funds");
+
+			auto refund = refunds.find(key);
+			balances.modify(bal, same_payer, [&](auto& b){
+				b.locked.amount -= amount;
+				if(refund != refunds.end()){
+					b.available.amount += refund->second;
+				}
 			});
 		}
-		return next_id;
 	}
+
 };
\ No newline at end of file
@@ -32,6 +32,13 @@ function run(cmd, options = {}) {
 
     console.log(`Using ${HAS_LOCAL_CDT ? "local" : "dockerized"} CDT compiler`);
 
+    // TOTEMS_DEBUG=1 enables debug-only output in the library (read cache stats, etc)
+    // TOTEMS_LICENSE_POLICY=DIRECT_ONLY|PROXY_ONLY|... overrides the library's license lookup policy
+    const DEFINES = [
+        process.env.TOTEMS_DEBUG ? "-DTOTEMS_DEBUG" : "",
+        process.env.TOTEMS_LICENSE_POLICY ? `-DTOTEMS_LICENSE_POLICY=${process.env.TOTEMS_LICENSE_POLICY}` : "",
+    ].filter(Boolean).join(" ");
+
     async function buildContract(contractDir, contractName, outputDir) {
         console.log(`Building: ${contractName}`);
 
@@ -46,7 +53,7 @@ function run(cmd, options = {}) {
             if (HAS_LOCAL_CDT) {
                 await run(
                     `cdt-cpp ${cppFile} -o ${wasmOut} ` +
-                    `-I ${absContractDir}/include -I contracts/library --abigen`
+                    `-I ${absContractDir}/include -I contracts/library ${DEFINES} --abigen`
                 );
             } else {
                 const dockerCmd = `
@@ -59,6 +66,7 @@ cdt-cpp ${contractDir}/${contractName}.cpp \
 -o /work/build/${contractName}.wasm \
 -I ${contractDir}/include \
 -I contracts/library \
+${DEFINES} \
 --abigen"
                 `.trim().replace(/\s+/g, " ");
 
@@ -13,7 +13,7 @@ import {
     setup,
     totemMods, totems, vaulta
 } from "./helpers";
-import {Asset, TimePointSec} from "@wharfkit/antelope";
+import {Asset, Checksum256, KeyWeight, Name, PrivateKey, Serializer, TimePointSec, UInt64} from "@wharfkit/antelope";
 import SymbolCode = Asset.SymbolCode;
 
 const allowances = blockchain.createContract('allowances', 'build/allowances',  true);
@@ -30,6 +30,20 @@ const getEscrowBalance = async (account: string) => {
     ).split(' ')[0])
 }
 
+// sha256(domain | contract | owner | spender | allowance | nonce | deadline), same layout as the contract
+const signPermit = (owner: string, spender: string, allowance: string, nonce: number, deadline: string, key: PrivateKey) => {
+    const data = new Uint8Array([
+        ...Serializer.encode({object: Name.from('permit')}).array,
+        ...Serializer.encode({object: Name.from('allowances')}).array,
+        ...Serializer.encode({object: Name.from(owner)}).array,
+        ...Serializer.encode({object: Name.from(spender)}).array,
+        ...Serializer.encode({object: Asset.from(allowance)}).array,
+        ...Serializer.encode({object: UInt64.from(nonce)}).array,
+        ...Serializer.encode({object: TimePointSec.from(deadline)}).array,
+    ]);
+    return { owner, spender, allowance, nonce, deadline, sig: key.signDigest(Checksum256.hash(data)).toString() };
+}
+
 describe('Allowances', () => {
     it('should setup tests', async () => {
         await setup();
@@ -70,6 +84,12 @@ describe('Allowances', () => {
 
         await allowances.actions.approve(['user', 'user2', '500.0000 ALLOW']).send('user');
         assert(await getAllowance('user', 'user2') === 500, 'Expected allowance to be 500');
+
+        // one row per (owner, spender), scoped by owner and keyed by spender
+        const rows = JSON.parse(JSON.stringify(allowances.tables.approvals(nameToBigInt('user')).getTableRows()));
+        assert(rows.length === 1, `Expected 1 approval row, got ${rows.length}`);
+        assert(rows[0].spender === 'user2', `Expected spender to be user2, got ${rows[0].spender}`);
+        assert(rows[0].allowances.length === 1 && rows[0].allowances[0] === '500.0000 ALLOW', `Unexpected allowances ${rows[0].allowances}`);
     });
     it('should be able to spend allowances', async () => {
         // cannot spend from wrong user
@@ -82,7 +102,8 @@ describe('Allowances', () => {
             allowances.actions.spend(['user', 'user2', 'user2', '200.0000 ALLOW', 'memo']).send('user2'),
             "eosio_assert: Owner has no balance for this totem."
         );
-        // cannot just send totems, needs to open balance first
+        // cannot just send totems once the contract won't pay for more balances, needs to open balance first
+        await allowances.actions.setquota([0]).send('allowances');
         await expectToThrow(
             totems.actions.transfer(['user', 'allowances', '500.0000 ALLOW', 'escrow for allowances mod']).send('user'),
             "eosio_assert: You must open a balance first."
@@ -113,6 +134,7 @@ describe('Allowances', () => {
         const allowanceAfter = await getAllowance('user', 'user2');
         assert(allowanceBefore > 0, 'Expected allowance before to be greater than 0');
         assert(allowanceAfter === 0, 'Expected allowance after to be 0');
+        assert(allowances.tables.approvals(nameToBigInt('user')).getTableRows().length === 0, 'Expected the approval row to be removed');
     });
     it('should no longer be able to spend allowances', async () => {
         await expectToThrow(
@@ -139,4 +161,187 @@ describe('Allowances', () => {
             "eosio_assert: Insufficient balance."
         );
     });
+    it('should be able to spend to many recipients at once', async () => {
+        await totems.actions.transfer(['user', 'allowances', '100.0000 ALLOW', 'escrow for allowances mod']).send('user');
+        await allowances.actions.approve(['user', 'user2', '60.0000 ALLOW']).send('user');
+
+        const user2Before = getTotemBalance('user2', 'ALLOW');
+        const user3Before = getTotemBalance('user3', 'ALLOW');
+        await allowances.actions.spendmany(['user', 'user2', [
+            { recipient: 'user2', quantity: '20.0000 ALLOW', memo: 'payroll' },
+            { recipient: 'user3', quantity: '30.0000 ALLOW', memo: 'payroll' },
+        ]]).send('user2');
+
+        assert(getTotemBalance('user2', 'ALLOW') - user2Before === 20, 'Expected user2 to have received 20 ALLOW');
+        assert(getTotemBalance('user3', 'ALLOW') - user3Before === 30, 'Expected user3 to have received 30 ALLOW');
+        assert(await getAllowance('user', 'user2') === 10, 'Expected allowance to be 10');
+        assert(await getEscrowBalance('user') === 50, 'Expected escrow balance to be 50');
+
+        // the total has to fit in the allowance, even if every single payment would
+        await expectToThrow(
+            allowances.actions.spendmany(['user', 'user2', [
+                { recipient: 'user2', quantity: '5.0000 ALLOW', memo: '' },
+                { recipient: 'user3', quantity: '6.0000 ALLOW', memo: '' },
+            ]]).send('user2'),
+            "eosio_assert: Insufficient allowance to spend."
+        );
+
+        // four of the largest amounts wrap an int64 total around to -4, which must not pass the allowance check
+        await expectToThrow(
+            allowances.actions.spendmany(['user', 'user2', [0, 1, 2, 3].map(() =>
+                ({ recipient: 'user2', quantity: '461168601842738.7903 ALLOW', memo: '' })
+            )]).send('user2'),
+            "eosio_assert: addition overflow"
+        );
+        assert(await getAllowance('user', 'user2') === 10, 'Expected the allowance to be untouched');
+    });
+    it('should only accept valid permits', async () => {
+        blockchain.setTime(TimePointSec.fromString('2025-01-01T00:00:00'));
+        const key = PrivateKey.generate('K1');
+        const spend = (permit: any) =>
+            allowances.actions.permitspend([permit, 'user3', '1.0000 ALLOW', 'memo']).send('user3');
+
+        assert(Number((await allowances.actions.getnonce(['user']).send())[0].returnValue) === 0, 'Expected first nonce to be 0');
+
+        await expectToThrow(
+            spend(signPermit('user', 'user3', '10.0000 ALLOW', 0, '2024-12-31T00:00:00', key)),
+            "eosio_assert: Permit has expired."
+        );
+        await expectToThrow(
+            spend(signPermit('user', 'user3', '10.0000 ALLOW', 1, '2025-01-02T00:00:00', key)),
+            "eosio_assert: Invalid permit nonce."
+        );
+        // not signed by one of user's keys
+        await expectToThrow(
+            spend(signPermit('user', 'user3', '10.0000 ALLOW', 0, '2025-01-02T00:00:00', key)),
+            "eosio_assert: Invalid permit signature."
+        );
+        assert(await getAllowance('user', 'user3') === 0, 'Expected no allowance to have been set');
+    });
+    it('should be able to spend with a permit signed by one of the owner\'s keys', async () => {
+        const key = PrivateKey.generate('K1');
+        const spend = (permit: any) =>
+            allowances.actions.permitspend([permit, 'user3', '1.0000 ALLOW', 'memo']).send('user3');
+
+        // let the key sign for user's active permission on its own
+        const active = blockchain.getAccount(Name.from('user'))!.permissions.find((p:any) => p.perm_name.equals('active'))!;
+        active.required_auth.keys.push(KeyWeight.from({ key: key.toPublic(), weight: active.required_auth.threshold }));
+
+        const escrowBefore = await getEscrowBalance('user');
+        const recipientBefore = getTotemBalance('user3', 'ALLOW');
+        const permit = signPermit('user', 'user3', '10.0000 ALLOW', 0, '2025-01-02T00:00:00', key);
+        await spend(permit);
+
+        assert(Number((await allowances.actions.getnonce(['user']).send())[0].returnValue) === 1, 'Expected the nonce to be used up');
+        assert(await getAllowance('user', 'user3') === 9, 'Expected the permit allowance minus the spend');
+        assert(escrowBefore - await getEscrowBalance('user') === 1, 'Expected 1 ALLOW to leave the owner\'s escrow');
+        assert(getTotemBalance('user3', 'ALLOW') - recipientBefore === 1, 'Expected the recipient to have received 1 ALLOW');
+
+        // the same permit can't be used twice
+        await expectToThrow(spend(permit), "eosio_assert: Invalid permit nonce.");
+    });
+    it('should be able to list allowances by owner and by spender', async () => {
+        const getApprovals = async (owner: string, limit: number, cursor = null) =>
+            JSON.parse(JSON.stringify((await allowances.actions.getapprovals([owner, '4,ALLOW', limit, cursor]).send())[0].returnValue));
+        const getBySpender = async (spender: string, limit: number, cursor = null) =>
+            JSON.parse(JSON.stringify((await allowances.actions.getbyspender([spender, '4,ALLOW', limit, cursor]).send())[0].returnValue));
+
+        await allowances.actions.approve(['user', 'user3', '5.0000 ALLOW']).send('user');
+        await allowances.actions.approve(['user2', 'user3', '7.0000 ALLOW']).send('user2');
+
+        const page1 = await getApprovals('user', 1);
+        assert(page1.allowances.length === 1, `Expected 1 allowance, got ${page1.allowances.length}`);
+        assert(page1.allowances[0].spender === 'user2' && page1.allowances[0].allowance === '10.0000 ALLOW', `Unexpected first allowance ${JSON.stringify(page1.allowances[0])}`);
+        const page2 = await getApprovals('user', 1, page1.cursor);
+        assert(page2.allowances.length === 1, `Expected 1 allowance, got ${page2.allowances.length}`);
+        assert(page2.allowances[0].spender === 'user3' && page2.allowances[0].allowance === '5.0000 ALLOW', `Unexpected second allowance ${JSON.stringify(page2.allowances[0])}`);
+        assert(page2.cursor === null, 'Expected no cursor after the last spender');
+
+        const bySpender = await getBySpender('user3', 10);
+        assert(bySpender.allowances.length === 2, `Expected 2 allowances, got ${bySpender.allowances.length}`);
+        assert(bySpender.allowances[0].owner === 'user' && bySpender.allowances[0].allowance === '5.0000 ALLOW', `Unexpected first allowance ${JSON.stringify(bySpender.allowances[0])}`);
+        assert(bySpender.allowances[1].owner === 'user2' && bySpender.allowances[1].allowance === '7.0000 ALLOW', `Unexpected second allowance ${JSON.stringify(bySpender.allowances[1])}`);
+
+        // pages are bounded by the rows they look at, even when none of them match the totem
+        const otherTotem = JSON.parse(JSON.stringify((await allowances.actions.getapprovals(['user', '4,OTHER', 1, null]).send())[0].returnValue));
+        assert(otherTotem.allowances.length === 0, `Expected no allowances, got ${otherTotem.allowances.length}`);
+        assert(otherTotem.cursor === 'user2', `Expected to continue after user2, got ${otherTotem.cursor}`);
+        // the spender lookup is keyed by totem, so it only visits matching rows
+        const otherBySpender = JSON.parse(JSON.stringify((await allowances.actions.getbyspender(['user3', '4,OTHER', 1, null]).send())[0].returnValue));
+        assert(otherBySpender.allowances.length === 0 && otherBySpender.cursor === null, 'Expected an empty last page');
+        const firstBySpender = await getBySpender('user3', 1);
+        assert(firstBySpender.allowances.length === 1 && firstBySpender.cursor === 'user', `Expected to continue after user, got ${firstBySpender.cursor}`);
+        const lastBySpender = await getBySpender('user3', 1, firstBySpender.cursor);
+        assert(lastBySpender.allowances[0].owner === 'user2' && lastBySpender.cursor === null, 'Expected user2 on the last page');
+
+        // removing an allowance removes it from the spender's lookup too
+        await allowances.actions.approve(['user', 'user3', '0.0000 ALLOW']).send('user');
+        const afterRemoval = await getBySpender('user3', 10);
+        assert(afterRemoval.allowances.length === 1 && afterRemoval.allowances[0].owner === 'user2', 'Expected only user2 to be left');
+        assert(allowances.tables.grants(nameToBigInt('user3')).getTableRows().length === 1, 'Expected the lookup row to be removed');
+    });
+    it('should not bring back legacy allowances that were approved again', async () => {
+        const ticker = symbolCodeToBigInt(SymbolCode.from('ALLOW'));
+        // allowances as the old contract stored them
+        const setLegacy = (id: number, owner: string, spender: string, allowance: string) =>
+            allowances.tables.allowances(ticker).set(BigInt(id), owner, { id, owner, spender, allowance });
+
+        setLegacy(0, 'user2', 'user', '3.0000 ALLOW');
+        setLegacy(1, 'user3', 'user', '4.0000 ALLOW');
+        assert(await getAllowance('user2', 'user') === 3, 'Expected the legacy allowance to be readable');
+
+        // removing an allowance that only exists in the legacy table, and replacing one
+        await allowances.actions.approve(['user2', 'user', '0.0000 ALLOW']).send('user2');
+        await allowances.actions.approve(['user3', 'user', '6.0000 ALLOW']).send('user3');
+        assert(allowances.tables.allowances(ticker).getTableRows().length === 0, 'Expected approve to drop the legacy rows');
+
+        // a legacy row left behind for an allowance that's already in approvals doesn't overwrite it
+        setLegacy(2, 'user3', 'user', '4.0000 ALLOW');
+        await allowances.actions.migrate(['ALLOW', 10]).send('allowances');
+        assert(allowances.tables.allowances(ticker).getTableRows().length === 0, 'Expected the legacy table to be empty');
+        assert(await getAllowance('user2', 'user') === 0, 'Expected the removed allowance to stay removed');
+        assert(await getAllowance('user3', 'user') === 6, 'Expected the new allowance to be kept');
+    });
+    it('should be able to spend allowances that only exist in the legacy table', async () => {
+        const ticker = symbolCodeToBigInt(SymbolCode.from('ALLOW'));
+        allowances.tables.allowances(ticker).set(BigInt(3), 'user', { id: 3, owner: 'user', spender: 'seller', allowance: '5.0000 ALLOW' });
+
+        // listed alongside the migrated allowances, in spender order
+        const listed = JSON.parse(JSON.stringify((await allowances.actions.getapprovals(['user', '4,ALLOW', 10, null]).send())[0].returnValue));
+        assert(listed.allowances.map((a:any) => a.spender).join(',') === 'seller,user2', `Unexpected spenders ${listed.allowances.map((a:any) => a.spender)}`);
+        assert(listed.allowances[0].allowance === '5.0000 ALLOW', `Expected the legacy allowance, got ${listed.allowances[0].allowance}`);
+        assert(listed.cursor === null, 'Expected no cursor after the last spender');
+
+        const escrowBefore = await getEscrowBalance('user');
+        await allowances.actions.spend(['user', 'seller', 'seller', '2.0000 ALLOW', 'memo']).send('seller');
+        assert(await getAllowance('user', 'seller') === 3, 'Expected the legacy allowance minus the spend');
+        assert(escrowBefore - await getEscrowBalance('user') === 2, 'Expected 2 ALLOW to leave the owner\'s escrow');
+
+        // spending moved it over
+        assert(allowances.tables.allowances(ticker).getTableRows().length === 0, 'Expected the legacy row to be gone');
+        const rows = JSON.parse(JSON.stringify(allowances.tables.approvals(nameToBigInt('user')).getTableRows()));
+        assert(rows.some((r:any) => r.spender === 'seller'), 'Expected the allowance to be in approvals');
+    });
+    it('should open balances on deposit and be able to close them', async () => {
+        const quotaUsed = () => Number(JSON.parse(JSON.stringify(allowances.tables.openquota(nameToBigInt('allowances')).getTableRows()))[0].used);
+
+        await allowances.actions.setquota([10]).send('allowances');
+        assert(!(await allowances.actions.isopen(['user3', '4,ALLOW']).send())[0].returnValue, 'Expected user3 to have no balance yet');
+
+        const usedBefore = quotaUsed();
+        await totems.actions.transfer(['user3', 'allowances', '10.0000 ALLOW', '']).send('user3');
+        assert(await getEscrowBalance('user3') === 10, 'Expected the deposit to open a balance');
+        assert(quotaUsed() === usedBefore + 1, 'Expected the deposit to take a slot from the quota');
+
+        await expectToThrow(
+            allowances.actions.close(['user3', '4,ALLOW']).send('user3'),
+            "eosio_assert: Balance must be zero to close."
+        );
+
+        await allowances.actions.transfer(['user3', 'user3', '10.0000 ALLOW', 'withdraw']).send('user3');
+        await allowances.actions.close(['user3', '4,ALLOW']).send('user3');
+        assert(!(await allowances.actions.isopen(['user3', '4,ALLOW']).send())[0].returnValue, 'Expected the balance to be closed');
+        assert(quotaUsed() === usedBefore, 'Expected closing to give the slot back');
+    });
 });
+
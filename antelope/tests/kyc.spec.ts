@@ -1,6 +1,6 @@
 import { describe, it } from "node:test";
 import assert from "node:assert";
-import {expectToThrow, nameToBigInt} from "@vaulta/vert";
+import {expectToThrow, nameToBigInt, symbolCodeToBigInt} from "@vaulta/vert";
 import {
     ACCOUNTS,
     blockchain,
@@ -13,7 +13,8 @@ import {
     setup,
     totemMods, totems, vaulta
 } from "./helpers";
-import {TimePointSec} from "@wharfkit/antelope";
+import {Asset, TimePointSec} from "@wharfkit/antelope";
+import SymbolCode = Asset.SymbolCode;
 
 const kyc = blockchain.createContract('kyc', 'build/kyc',  true);
 const miner = blockchain.createContract('miner', 'build/miner',  true);
@@ -90,6 +91,15 @@ describe('KYC', () => {
         await kyc.actions.setkyc(['manager1','user', true]).send('manager1');
         await totems.actions.mint(['miner', 'user', '0.0000 KYC', '0.0000 A', '']).send('user');
     });
+    it('should have indexed the minter exemptions for the totem', async () => {
+        const exempt = JSON.parse(JSON.stringify(kyc.tables.exempt(symbolCodeToBigInt(SymbolCode.from('KYC'))).getTableRows()));
+        const accounts = exempt.map((row:any) => row.account);
+        // the empty name only marks the ticker as indexed
+        assert(accounts.length === 2, `Expected the marker and 1 exemption, got ${accounts.length}`);
+        assert(accounts.includes(''), `Expected the indexed marker`);
+        assert(accounts.includes('miner'), `Expected the miner to be exempt`);
+        assert(!accounts.includes('kyc'), `Expected the mod itself not to be exempt`);
+    });
     it('should not be able to transfer totems with or to a non-KYC account', async () => {
         await expectToThrow(
             totems.actions.transfer(['user', 'user2', '10.0000 KYC', 'memo']).send('user'),
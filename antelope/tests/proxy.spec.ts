@@ -1,11 +1,12 @@
 import { describe, it } from "node:test";
 import assert from "node:assert";
-import {expectToThrow, nameToBigInt} from "@vaulta/vert";
+import {expectToThrow, nameToBigInt, symbolCodeToBigInt} from "@vaulta/vert";
 import {
     ACCOUNTS,
     blockchain,
     createAccount,
     createTotem, eos,
+    getBalance,
     getTotemBalance,
     MOCK_MOD_DETAILS,
     MOD_HOOKS,
@@ -13,7 +14,8 @@ import {
     setup,
     totemMods, totems, vaulta
 } from "./helpers";
-import {TimePointSec} from "@wharfkit/antelope";
+import {Asset, TimePointSec} from "@wharfkit/antelope";
+import SymbolCode = Asset.SymbolCode;
 
 const proxy = blockchain.createContract('totemodproxy', 'build/proxy',  true);
 const freezer = blockchain.createContract('freezer', 'build/freezer',  true);
@@ -93,6 +95,35 @@ describe('Proxy', () => {
         );
         await eos.actions.transfer(['tester', 'totemodproxy', '1.0000 EOS', 'fund proxy for fee']).send('tester');
         await proxy.actions.add(['PROXY', ['transfer'], 'freezer']).send('creator');
+
+        // only the transfer hook gets a row
+        const subscribers = JSON.parse(JSON.stringify(proxy.tables.subscribers(symbolCodeToBigInt(SymbolCode.from('PROXY'))).getTableRows()));
+        assert(subscribers.length === 1, `Expected 1 hook row, got ${subscribers.length}`);
+        assert(subscribers[0].hook === 'transfer', `Expected transfer hook, got ${subscribers[0].hook}`);
+        assert(subscribers[0].mods.length === 1 && subscribers[0].mods[0] === 'freezer', `Expected freezer to be subscribed`);
+    });
+    it('should owe the mod fee to the seller until settled', async () => {
+        // small deposits are buffered instead of converted right away
+        const buffered = JSON.parse(JSON.stringify(proxy.tables.pendingeos(nameToBigInt('totemodproxy')).getTableRows()));
+        assert(buffered[0].balance === '1.0000 EOS', `Expected 1 EOS to be pending, got ${buffered[0].balance}`);
+
+        const owed = JSON.parse(JSON.stringify(proxy.tables.feesowed(nameToBigInt('totemodproxy')).getTableRows()));
+        assert(owed.length === 1, `Expected 1 owed fee, got ${owed.length}`);
+        assert(owed[0].recipient === 'seller', `Expected fee to be owed to seller, got ${owed[0].recipient}`);
+        assert(owed[0].amount === 1, `Expected 1 owed, got ${owed[0].amount}`);
+
+        const sellerBefore = getBalance('seller', vaulta);
+        // anyone can settle
+        await proxy.actions.settle([['seller']]).send('user');
+        const sellerAfter = getBalance('seller', vaulta);
+        assert((sellerAfter - sellerBefore).toFixed(4) === '0.0001', `Expected seller to be paid 0.0001 A, got ${sellerAfter - sellerBefore}`);
+
+        const owedAfter = proxy.tables.feesowed(nameToBigInt('totemodproxy')).getTableRows();
+        assert(owedAfter.length === 0, `Expected no owed fees after settling, got ${owedAfter.length}`);
+
+        // the buffered EOS deposit was converted to A to pay out the fee
+        const pending = JSON.parse(JSON.stringify(proxy.tables.pendingeos(nameToBigInt('totemodproxy')).getTableRows()));
+        assert(pending[0].balance === '0.0000 EOS', `Expected no pending EOS after settling, got ${pending[0].balance}`);
     });
     it('should be able to freeze the totem and disallow transfers', async () => {
         await freezer.actions.freeze(['PROXY']).send('creator');
@@ -114,5 +145,135 @@ describe('Proxy', () => {
     it('should be able to remove the burn hook and burn again', async () => {
         await proxy.actions.remove(['PROXY', 'burn', 'freezer']).send('creator');
         await totems.actions.burn(['user', '1.0000 PROXY', 'memo']).send('user');
+
+        // the empty burn hook row is dropped, the license stays since freezer is still on transfer
+        const subscribers = JSON.parse(JSON.stringify(proxy.tables.subscribers(symbolCodeToBigInt(SymbolCode.from('PROXY'))).getTableRows()));
+        assert(subscribers.length === 1, `Expected 1 hook row, got ${subscribers.length}`);
+        assert(subscribers[0].hook === 'transfer', `Expected transfer hook, got ${subscribers[0].hook}`);
+        const licenses = proxy.tables.licenses(symbolCodeToBigInt(SymbolCode.from('PROXY'))).getTableRows();
+        assert(licenses.length === 1, `Expected 1 license, got ${licenses.length}`);
+    });
+    it('should be able to batch remove and add mods', async () => {
+        await proxy.actions.removemany([[{ ticker: 'PROXY', mod: 'freezer', hooks: ['transfer'] }]]).send('creator');
+        await totems.actions.transfer(['user', 'user2', '1.0000 PROXY', 'memo']).send('user');
+
+        // nothing is left on any hook, so the rows and license are gone
+        assert(proxy.tables.subscribers(symbolCodeToBigInt(SymbolCode.from('PROXY'))).getTableRows().length === 0, 'Expected no hook rows');
+        assert(proxy.tables.licenses(symbolCodeToBigInt(SymbolCode.from('PROXY'))).getTableRows().length === 0, 'Expected no licenses');
+
+        // should not be able to configure a totem you didn't create
+        await expectToThrow(
+            proxy.actions.addmany([[{ ticker: 'PROXY', mod: 'freezer', hooks: ['transfer', 'burn'] }]]).send('user'),
+            "missing required authority creator"
+        );
+
+        await proxy.actions.addmany([[{ ticker: 'PROXY', mod: 'freezer', hooks: ['transfer', 'burn'] }]]).send('creator');
+        await expectToThrow(
+            totems.actions.transfer(['user', 'user2', '1.0000 PROXY', 'memo']).send('user'),
+            "eosio_assert: frozen!"
+        );
+        await expectToThrow(
+            totems.actions.burn(['user', '1.0000 PROXY', 'memo']).send('user'),
+            "eosio_assert: frozen!"
+        );
+    });
+    it('should validate hook names on remove and ignore hooks with nothing on them', async () => {
+        await expectToThrow(
+            proxy.actions.remove(['PROXY', 'notahook', 'freezer']).send('creator'),
+            "eosio_assert: Invalid hook name"
+        );
+        await proxy.actions.remove(['PROXY', 'mint', 'freezer']).send('creator');
+    });
+    it('should still notify mods on a ticker that was never migrated', async () => {
+        await proxy.actions.removemany([[{ ticker: 'PROXY', mod: 'freezer', hooks: ['transfer'] }]]).send('creator');
+
+        // put the ticker back in the legacy single-row layout
+        const scope = nameToBigInt('totemodproxy');
+        proxy.tables.proxies(scope).set(symbolCodeToBigInt(SymbolCode.from('PROXY')), 'totemodproxy', {
+            ticker: 'PROXY',
+            transfer: ['freezer'],
+            mint: [],
+            burn: [],
+            open: [],
+            close: [],
+            created: [],
+        });
+
+        await expectToThrow(
+            totems.actions.transfer(['user', 'user2', '1.0000 PROXY', 'memo']).send('user'),
+            "eosio_assert: frozen!"
+        );
+
+        // notifications only read the legacy row, configuring the ticker moves it over
+        await proxy.actions.add(['PROXY', ['burn'], 'freezer']).send('creator');
+        assert(proxy.tables.proxies(scope).getTableRows().length === 0, 'Expected the legacy row to be migrated');
+        const subscribers = JSON.parse(JSON.stringify(proxy.tables.subscribers(symbolCodeToBigInt(SymbolCode.from('PROXY'))).getTableRows()));
+        assert(subscribers.length === 2, `Expected 2 hook rows, got ${subscribers.length}`);
+    });
+    it('should migrate legacy rows in pages', async () => {
+        const scope = nameToBigInt('totemodproxy');
+        const setLegacy = (ticker: string, transfer: string[], burn: string[]) =>
+            proxy.tables.proxies(scope).set(symbolCodeToBigInt(SymbolCode.from(ticker)), 'totemodproxy', {
+                ticker, transfer, mint: [], burn, open: [], close: [], created: [],
+            });
+        const hooks = (ticker: string) =>
+            JSON.parse(JSON.stringify(proxy.tables.subscribers(symbolCodeToBigInt(SymbolCode.from(ticker))).getTableRows()));
+
+        setLegacy('AAA', ['freezer'], []);
+        setLegacy('BBB', ['freezer', 'miner'], ['freezer']);
+        setLegacy('CCC', [], []);
+
+        await expectToThrow(
+            proxy.actions.migrate([2]).send('user'),
+            "missing required authority totemodproxy"
+        );
+
+        await proxy.actions.migrate([2]).send('totemodproxy');
+        assert(proxy.tables.proxies(scope).getTableRows().length === 1, 'Expected 1 legacy row to be left');
+        assert(proxy.tables.migration(scope).getTableRows().length === 0, 'Expected the migration to not be done yet');
+
+        const aaa = hooks('AAA');
+        assert(aaa.length === 1 && aaa[0].hook === 'transfer' && aaa[0].mods.join(',') === 'freezer', `Unexpected AAA hooks ${JSON.stringify(aaa)}`);
+        const bbb = hooks('BBB');
+        assert(bbb.length === 2, `Expected 2 hook rows for BBB, got ${bbb.length}`);
+        assert(bbb.find((row:any) => row.hook === 'transfer').mods.join(',') === 'freezer,miner', 'Expected both mods on BBB transfer');
+        assert(bbb.find((row:any) => row.hook === 'burn').mods.join(',') === 'freezer', 'Expected freezer on BBB burn');
+
+        // empty hooks don't get rows
+        await proxy.actions.migrate([2]).send('totemodproxy');
+        assert(proxy.tables.proxies(scope).getTableRows().length === 0, 'Expected the legacy table to be empty');
+        assert(hooks('CCC').length === 0, 'Expected no hook rows for CCC');
+        assert(proxy.tables.migration(scope).getTableRows().length === 1, 'Expected the migration to be marked done');
+    });
+    it('should garbage collect orphaned licenses and empty hooks', async () => {
+        const ticker = symbolCodeToBigInt(SymbolCode.from('PROXY'));
+        const gc = async (cursor: string | null, limit: number) =>
+            JSON.parse(JSON.stringify((await proxy.actions.gc(['PROXY', cursor, limit]).send('user'))[0].returnValue));
+        const licenses = () => JSON.parse(JSON.stringify(proxy.tables.licenses(ticker).getTableRows())).map((row:any) => row.mod);
+
+        // a license for a mod that isn't on any hook, and a hook row with nothing on it
+        proxy.tables.licenses(ticker).set(nameToBigInt('miner'), 'totemodproxy', { mod: 'miner' });
+        proxy.tables.subscribers(ticker).set(nameToBigInt('mint'), 'totemodproxy', { hook: 'mint', mods: [] });
+        assert(licenses().join(',') === 'freezer,miner', `Unexpected licenses ${licenses()}`);
+
+        // licenses are paged by the limit, freezer is still on a hook so it stays
+        const cursor = await gc(null, 1);
+        assert(cursor === 'freezer', `Expected to continue after freezer, got ${cursor}`);
+        assert(licenses().join(',') === 'freezer,miner', 'Expected nothing to be removed yet');
+        const hooks = JSON.parse(JSON.stringify(proxy.tables.subscribers(ticker).getTableRows()));
+        assert(!hooks.some((row:any) => row.hook === 'mint'), 'Expected the empty mint hook to be removed');
+
+        const done = await gc(cursor, 10);
+        assert(done === null, `Expected nothing left to check, got ${done}`);
+        assert(licenses().join(',') === 'freezer', `Expected only freezer to be left, got ${licenses()}`);
+    });
+    it('should not garbage collect a ticker that is still in the legacy layout', async () => {
+        proxy.tables.proxies(nameToBigInt('totemodproxy')).set(symbolCodeToBigInt(SymbolCode.from('DDD')), 'totemodproxy', {
+            ticker: 'DDD', transfer: ['freezer'], mint: [], burn: [], open: [], close: [], created: [],
+        });
+        await expectToThrow(
+            proxy.actions.gc(['DDD', null, 10]).send('user'),
+            "eosio_assert: This totem ticker must be migrated first"
+        );
     });
 });
@@ -13,7 +13,7 @@ import {
     setup,
     totemMods, totems, vaulta
 } from "./helpers";
-import {Asset, TimePointSec} from "@wharfkit/antelope";
+import {Asset, Bytes, Checksum256, Name, PrivateKey, Serializer, TimePointSec, UInt64} from "@wharfkit/antelope";
 import SymbolCode = Asset.SymbolCode;
 
 const x4o2 = blockchain.createContract('x4o2', 'build/x402',  true);
@@ -38,6 +38,19 @@ const getLockedEscrowBalance = async (account: string) => {
     ).split(' ')[0])
 }
 
+const CHANNEL_KEY = PrivateKey.generate('K1');
+
+// sha256(domain | contract | channel id | cumulative), same layout as the contract
+const signVoucher = (id: number, cumulative: string, key = CHANNEL_KEY) => {
+    const data = new Uint8Array([
+        ...Serializer.encode({object: Name.from('voucher')}).array,
+        ...Serializer.encode({object: Name.from('x4o2')}).array,
+        ...Serializer.encode({object: UInt64.from(id)}).array,
+        ...Serializer.encode({object: Asset.from(cumulative)}).array,
+    ]);
+    return { cumulative, sig: key.signDigest(Checksum256.hash(data)).toString() };
+}
+
 const getMyIntents = async (account: string, limit = 100, cursor = null) => {
     const intents = await x4o2.actions.getmyintents([account, limit, cursor]).send();
     return JSON.parse(JSON.stringify(intents[0].returnValue));
@@ -140,6 +153,7 @@ describe('x402', () => {
         assert(await getLockedEscrowBalance('user') === 100, 'Expected locked balance to be 100 after creating intent');
         assert(await getEscrowBalance('user') === 100, 'Expected unlocked balance to be 100 after creating intent');
 
+        // ids are never reused, even though the table is empty again
         assert(intent.id === 1, `Expected intent id to be 1, got ${intent.id}`);
         const intentBefore = await getIntent(1);
         assert(!!intentBefore, 'Expected intent to exist before revocation');
@@ -192,4 +206,365 @@ describe('x402', () => {
             "eosio_assert: Insufficient balance."
         );
     });
+    it('should be able to consume many intents at once', async () => {
+        // ids and hashes need to line up
+        await expectToThrow(
+            x4o2.actions.consumemany([[2, 3], [HASH]]).send('user2'),
+            "eosio_assert: Every intent needs a request hash"
+        );
+
+        const lockedBefore = await getLockedEscrowBalance('user');
+        const consumerBefore = await getEscrowBalance('user2');
+        await x4o2.actions.consumemany([[2, 3, 4], [HASH, HASH, HASH]]).send('user2');
+
+        assert(await getEscrowBalance('user2') - consumerBefore === 3, 'Expected consumer to have been credited 3 XPAY');
+        assert(lockedBefore - await getLockedEscrowBalance('user') === 3, 'Expected 3 XPAY to be unlocked');
+        for(const id of [2, 3, 4]){
+            assert(!(await getIntent(id)), `Expected intent ${id} to be removed after consumption`);
+        }
+
+        // cannot consume the same intent twice
+        await expectToThrow(
+            x4o2.actions.consumemany([[5, 5], [HASH, HASH]]).send('user2'),
+            "eosio_assert: Invalid or already used intent"
+        );
+    });
+    it('should be able to sweep expired intents', async () => {
+        // nothing has expired yet
+        const swept = Number((await x4o2.actions.sweep([10]).send('user3'))[0].returnValue);
+        assert(swept === 0, `Expected nothing to be swept, got ${swept}`);
+
+        blockchain.setTime(TimePointSec.fromString('1970-01-02T00:00:00'));
+
+        const lockedBefore = await getLockedEscrowBalance('user');
+        const balanceBefore = await getEscrowBalance('user');
+
+        // oldest first, and bounded by the limit
+        const sweptOne = Number((await x4o2.actions.sweep([1]).send('user3'))[0].returnValue);
+        assert(sweptOne === 1, `Expected 1 intent to be swept, got ${sweptOne}`);
+        assert(!(await getIntent(5)), 'Expected intent 5 to be removed');
+        assert(!!(await getIntent(6)), 'Expected intent 6 to still exist');
+
+        const sweptRest = Number((await x4o2.actions.sweep([10]).send('user3'))[0].returnValue);
+        assert(sweptRest === 1, `Expected 1 intent to be swept, got ${sweptRest}`);
+        assert(!(await getIntent(6)), 'Expected intent 6 to be removed');
+
+        assert(lockedBefore - await getLockedEscrowBalance('user') === 2, 'Expected 2 XPAY to be unlocked');
+        assert(await getEscrowBalance('user') - balanceBefore === 2, 'Expected 2 XPAY to be returned to the owner');
+    });
+    it('should be able to pay through a channel with off-chain vouchers', async () => {
+        const availableBefore = await getEscrowBalance('user');
+        const consumerBefore = await getEscrowBalance('user2');
+
+        const channel = JSON.parse(JSON.stringify(
+            (await x4o2.actions.openchannel(['user', 'user2', '10.0000 XPAY', CHANNEL_KEY.toPublic().toString(), 3600]).send('user'))[0].returnValue
+        ));
+        assert(channel.id === 0, `Expected channel id to be 0, got ${channel.id}`);
+        assert(await getLockedEscrowBalance('user') === 10, 'Expected the whole budget to be locked');
+        assert(availableBefore - await getEscrowBalance('user') === 10, 'Expected the budget to leave the spendable balance');
+
+        // only the channel's signer can sign vouchers
+        await expectToThrow(
+            x4o2.actions.settle([0, signVoucher(0, '3.0000 XPAY', PrivateKey.generate('K1'))]).send('user2'),
+            "eosio_assert: Invalid voucher signature"
+        );
+        await expectToThrow(
+            x4o2.actions.settle([0, signVoucher(0, '11.0000 XPAY')]).send('user2'),
+            "eosio_assert: Voucher exceeds channel budget"
+        );
+
+        await x4o2.actions.settle([0, signVoucher(0, '3.0000 XPAY')]).send('user2');
+        assert(await getEscrowBalance('user2') - consumerBefore === 3, 'Expected consumer to have been credited 3 XPAY');
+        assert(await getLockedEscrowBalance('user') === 7, 'Expected 7 XPAY to still be locked');
+
+        // vouchers are cumulative, an old one can't be paid again
+        await expectToThrow(
+            x4o2.actions.settle([0, signVoucher(0, '3.0000 XPAY')]).send('user2'),
+            "eosio_assert: Voucher already settled"
+        );
+
+        // closing pays the difference and gives the rest back to the owner
+        await x4o2.actions.closechannel([0, signVoucher(0, '5.0000 XPAY')]).send('user2');
+        assert(await getEscrowBalance('user2') - consumerBefore === 5, 'Expected consumer to have been credited 5 XPAY in total');
+        assert(await getLockedEscrowBalance('user') === 0, 'Expected nothing to be locked after closing');
+        assert(availableBefore - await getEscrowBalance('user') === 5, 'Expected the unspent budget to be returned');
+        assert(!(await x4o2.actions.getchannel([0]).send())[0].returnValue, 'Expected channel to be removed');
+    });
+    it('should be able to reclaim an expired channel', async () => {
+        const availableBefore = await getEscrowBalance('user');
+        const channel = JSON.parse(JSON.stringify(
+            (await x4o2.actions.openchannel(['user', 'user2', '10.0000 XPAY', CHANNEL_KEY.toPublic().toString(), 60]).send('user'))[0].returnValue
+        ));
+        // the first channel is closed, but its id is never handed out again
+        assert(channel.id === 1, `Expected channel id to be 1, got ${channel.id}`);
+
+        // a voucher for the closed channel, signed by the same key, can't be replayed against this one
+        await expectToThrow(
+            x4o2.actions.settle([1, signVoucher(0, '5.0000 XPAY')]).send('user2'),
+            "eosio_assert: Invalid voucher signature"
+        );
+
+        await expectToThrow(
+            x4o2.actions.reclaim([1]).send('user'),
+            "eosio_assert: Channel has not expired yet"
+        );
+
+        blockchain.setTime(TimePointSec.fromString('1970-01-02T00:02:00'));
+        await expectToThrow(
+            x4o2.actions.settle([1, signVoucher(1, '1.0000 XPAY')]).send('user2'),
+            "eosio_assert: Channel has expired"
+        );
+
+        await x4o2.actions.reclaim([1]).send('user');
+        assert(await getEscrowBalance('user') === availableBefore, 'Expected the whole budget to be returned');
+        assert(await getLockedEscrowBalance('user') === 0, 'Expected nothing to be locked after reclaiming');
+    });
+    it('should be able to authorize many intents at once', async () => {
+        const available = await getEscrowBalance('user');
+
+        // the total has to fit in the balance, even if every single intent would
+        await expectToThrow(
+            x4o2.actions.authmany(['user', [
+                { consumer: 'user2', price: `${available.toFixed(4)} XPAY`, request_hash: HASH, expires_sec: 3600 },
+                { consumer: 'user3', price: '1.0000 XPAY', request_hash: HASH, expires_sec: 3600 },
+            ]]).send('user'),
+            "eosio_assert: Insufficient funds to authorize intent"
+        );
+
+        // four of the largest prices wrap an int64 total around to -4, which must not unlock anything
+        const MAX_PRICE = '461168601842738.7903 XPAY';
+        await expectToThrow(
+            x4o2.actions.authmany(['user', [0, 1, 2, 3].map(() =>
+                ({ consumer: 'user2', price: MAX_PRICE, request_hash: HASH, expires_sec: 3600 })
+            )]).send('user'),
+            "eosio_assert: addition overflow"
+        );
+        assert(await getEscrowBalance('user') === available, 'Expected the balance to be untouched');
+
+        const intents = JSON.parse(JSON.stringify(
+            (await x4o2.actions.authmany(['user', [
+                { consumer: 'user2', price: '1.0000 XPAY', request_hash: HASH, expires_sec: 3600 },
+                { consumer: 'user2', price: '2.0000 XPAY', request_hash: HASH, expires_sec: 3600 },
+                { consumer: 'user3', price: '3.0000 XPAY', request_hash: HASH, expires_sec: 7200 },
+            ]]).send('user'))[0].returnValue
+        ));
+
+        assert(intents.length === 3, `Expected 3 intents, got ${intents.length}`);
+        // the table was emptied by the sweep, ids still carry on from the last one removed
+        assert(intents.map((i:any) => i.id).join(',') === '7,8,9', `Expected ids 7,8,9, got ${intents.map((i:any) => i.id)}`);
+        assert(intents[2].consumer === 'user3', `Expected third intent consumer to be user3, got ${intents[2].consumer}`);
+        assert(await getLockedEscrowBalance('user') === 6, 'Expected 6 XPAY to be locked');
+        assert(available - await getEscrowBalance('user') === 6, 'Expected 6 XPAY to leave the spendable balance');
+    });
+    it('should keep spendable and locked totems in one balance row', async () => {
+        const rows = JSON.parse(JSON.stringify(x4o2.tables.balances(nameToBigInt('user')).getTableRows()));
+        assert(rows.length === 1, `Expected 1 balance row, got ${rows.length}`);
+        assert(rows[0].available === `${(await getEscrowBalance('user')).toFixed(4)} XPAY`, `Unexpected available balance ${rows[0].available}`);
+        assert(rows[0].locked === '6.0000 XPAY', `Expected 6.0000 XPAY locked, got ${rows[0].locked}`);
+
+        // nothing left in the legacy tables
+        assert(x4o2.tables.accounts(nameToBigInt('user')).getTableRows().length === 0, 'Expected no legacy balance rows');
+        assert(x4o2.tables.lockedbals(nameToBigInt('user')).getTableRows().length === 0, 'Expected no legacy locked rows');
+
+        await expectToThrow(
+            x4o2.actions.migratebals(['user']).send('user'),
+            "eosio_assert: Nothing to migrate"
+        );
+    });
+    it('should be able to get the intents addressed to a consumer', async () => {
+        const getPending = async (consumer: string, limit: number, cursor = null) =>
+            JSON.parse(JSON.stringify((await x4o2.actions.getpending([consumer, limit, cursor]).send())[0].returnValue));
+
+        const {cursor, intents} = await getPending('user2', 1);
+        assert(intents.length === 1, `Expected 1 intent, got ${intents.length}`);
+        assert(intents[0].id === 7, `Expected first intent id to be 7, got ${intents[0].id}`);
+
+        const {cursor: cursor2, intents: intents2} = await getPending('user2', 10, cursor);
+        assert(intents2.length === 1, `Expected 1 intent, got ${intents2.length}`);
+        assert(intents2[0].id === 8, `Expected second intent id to be 8, got ${intents2[0].id}`);
+
+        const {intents: intents3} = await getPending('user2', 10, cursor2);
+        assert(intents3.length === 0, `Expected no more intents, got ${intents3.length}`);
+
+        const {intents: user3Intents} = await getPending('user3', 10);
+        assert(user3Intents.length === 1 && user3Intents[0].id === 9, 'Expected only intent 9 for user3');
+    });
+    it('should be able to verify many intents in one call', async () => {
+        const OTHER_HASH = '8810ad581e59f2bc3928b261707a71308f7e139eb04820366dc4d5c18d980225';
+        // uint8_t[] comes back as bytes
+        const verify = async (ids: number[], hashes: string[]) =>
+            Array.from(Bytes.from((await x4o2.actions.verify(['user2', ids, hashes]).send())[0].returnValue).array);
+
+        const statuses = await verify([7, 8, 9, 99], [HASH, OTHER_HASH, HASH, HASH]);
+
+        assert(statuses[0] === 15, `Expected intent 7 to be valid, got ${statuses[0]}`);
+        assert(statuses[1] === 11, `Expected intent 8 to have a hash mismatch, got ${statuses[1]}`);
+        assert(statuses[2] === 7, `Expected intent 9 to be for another consumer, got ${statuses[2]}`);
+        assert(statuses[3] === 0, `Expected intent 99 to not exist, got ${statuses[3]}`);
+
+        blockchain.setTime(TimePointSec.fromString('1970-01-02T01:30:00'));
+        const [expired] = await verify([7], [HASH]);
+        assert(expired === 13, `Expected intent 7 to be expired, got ${expired}`);
+    });
+    it('should consume intents authorized under the old layout', async () => {
+        const scope = nameToBigInt('x4o2');
+        const lockedBefore = await getLockedEscrowBalance('user');
+        const available = await getEscrowBalance('user');
+
+        // two intents as the old contract stored them, with their totems already locked
+        const legacyIntent = (id: number) => ({
+            id,
+            owner: 'user',
+            consumer: 'user2',
+            price: '1.0000 XPAY',
+            request_hash: HASH,
+            expires: '1970-01-03T00:00:00',
+        });
+        x4o2.tables.intents(scope).set(BigInt(50), 'user', legacyIntent(50));
+        x4o2.tables.intents(scope).set(BigInt(51), 'user', legacyIntent(51));
+        x4o2.tables.balances(nameToBigInt('user')).set(symbolCodeToBigInt(SymbolCode.from('XPAY')), 'user', {
+            available: `${(available - 2).toFixed(4)} XPAY`,
+            locked: `${(lockedBefore + 2).toFixed(4)} XPAY`,
+        });
+
+        // consuming before the migration moves the intent over on the way
+        assert(!!(await getIntent(50)), 'Expected the legacy intent to be readable');
+        await x4o2.actions.consume([50, HASH]).send('user2');
+        assert(!(await getIntent(50)), 'Expected intent 50 to be consumed');
+
+        await x4o2.actions.migrate([10]).send('x4o2');
+        assert(x4o2.tables.intents(scope).getTableRows().length === 0, 'Expected the legacy table to be empty');
+        const migrated = JSON.parse(JSON.stringify(x4o2.tables.intentsv2(scope).getTableRows()));
+        assert(migrated.some((i:any) => Number(i.id) === 51), 'Expected intent 51 to be migrated');
+
+        await x4o2.actions.consume([51, HASH]).send('user2');
+        assert(!(await getIntent(51)), 'Expected intent 51 to be consumed');
+        assert(await getLockedEscrowBalance('user') === lockedBefore, 'Expected both legacy intents to be unlocked');
+    });
+    it('should consume intents for owners whose balance is still in the old layout', async () => {
+        const scope = nameToBigInt('x4o2');
+        const owner = nameToBigInt('seller');
+        const XPAY = symbolCodeToBigInt(SymbolCode.from('XPAY'));
+        const earnedBefore = await getEscrowBalance('user2');
+
+        // the old contract kept spendable and locked totems in separate rows
+        x4o2.tables.accounts(owner).set(XPAY, 'seller', { balance: '5.0000 XPAY' });
+        x4o2.tables.lockedbals(owner).set(XPAY, 'seller', { balance: '1.0000 XPAY' });
+        x4o2.tables.intents(scope).set(BigInt(70), 'seller', {
+            id: 70,
+            owner: 'seller',
+            consumer: 'user2',
+            price: '1.0000 XPAY',
+            request_hash: HASH,
+            expires: '1970-01-03T00:00:00',
+        });
+        assert(await getEscrowBalance('seller') === 5, 'Expected the legacy balance to be readable');
+        assert(await getLockedEscrowBalance('seller') === 1, 'Expected the legacy locked balance to be readable');
+
+        // nobody has run migratebals for this owner, consuming folds the balance on the way
+        await x4o2.actions.consume([70, HASH]).send('user2');
+        assert(await getEscrowBalance('user2') - earnedBefore === 1, 'Expected the consumer to be paid');
+        assert(await getEscrowBalance('seller') === 5, 'Expected the spendable balance to carry over');
+        assert(await getLockedEscrowBalance('seller') === 0, 'Expected the intent to be unlocked');
+        assert(x4o2.tables.accounts(owner).getTableRows().length === 0, 'Expected no legacy balance rows');
+        assert(x4o2.tables.lockedbals(owner).getTableRows().length === 0, 'Expected no legacy locked rows');
+    });
+    it('should fold legacy balances into the combined row with migratebals', async () => {
+        const owner = nameToBigInt('creator');
+        const XPAY = symbolCodeToBigInt(SymbolCode.from('XPAY'));
+
+        // a deposit opened a combined row before the legacy ones were folded in
+        x4o2.tables.balances(owner).set(XPAY, 'creator', { available: '1.0000 XPAY', locked: '0.0000 XPAY' });
+        x4o2.tables.accounts(owner).set(XPAY, 'creator', { balance: '3.0000 XPAY' });
+        x4o2.tables.lockedbals(owner).set(XPAY, 'creator', { balance: '2.0000 XPAY' });
+        assert(await getEscrowBalance('creator') === 4, 'Expected both layouts to be added up');
+        assert(await getLockedEscrowBalance('creator') === 2, 'Expected the legacy locked balance to be readable');
+
+        await x4o2.actions.migratebals(['creator']).send('creator');
+        const rows = JSON.parse(JSON.stringify(x4o2.tables.balances(owner).getTableRows()));
+        assert(rows.length === 1, `Expected 1 balance row, got ${rows.length}`);
+        assert(rows[0].available === '4.0000 XPAY', `Expected 4.0000 XPAY available, got ${rows[0].available}`);
+        assert(rows[0].locked === '2.0000 XPAY', `Expected 2.0000 XPAY locked, got ${rows[0].locked}`);
+        assert(x4o2.tables.accounts(owner).getTableRows().length === 0, 'Expected no legacy balance rows');
+        assert(x4o2.tables.lockedbals(owner).getTableRows().length === 0, 'Expected no legacy locked rows');
+    });
+    it('should only sweep legacy intents once they are migrated', async () => {
+        const scope = nameToBigInt('x4o2');
+        // clear out anything that already expired
+        await x4o2.actions.sweep([100]).send('user3');
+
+        const lockedBefore = await getLockedEscrowBalance('user');
+        const available = await getEscrowBalance('user');
+
+        // an expired intent as the old contract stored it, without a `byexpiry` entry
+        x4o2.tables.intents(scope).set(BigInt(60), 'user', {
+            id: 60,
+            owner: 'user',
+            consumer: 'user2',
+            price: '1.0000 XPAY',
+            request_hash: HASH,
+            expires: '1970-01-02T00:00:00',
+        });
+        x4o2.tables.balances(nameToBigInt('user')).set(symbolCodeToBigInt(SymbolCode.from('XPAY')), 'user', {
+            available: `${(available - 1).toFixed(4)} XPAY`,
+            locked: `${(lockedBefore + 1).toFixed(4)} XPAY`,
+        });
+
+        const skipped = Number((await x4o2.actions.sweep([100]).send('user3'))[0].returnValue);
+        assert(skipped === 0, `Expected the legacy intent to be skipped, got ${skipped}`);
+        assert(x4o2.tables.intents(scope).getTableRows().length === 1, 'Expected the legacy intent to still be there');
+
+        await x4o2.actions.migrate([10]).send('x4o2');
+        const swept = Number((await x4o2.actions.sweep([100]).send('user3'))[0].returnValue);
+        assert(swept === 1, `Expected the migrated intent to be swept, got ${swept}`);
+        assert(!(await getIntent(60)), 'Expected intent 60 to be removed');
+        assert(await getLockedEscrowBalance('user') === lockedBefore, 'Expected the intent to be unlocked');
+        assert(await getEscrowBalance('user') === available, 'Expected the intent to be refunded');
+    });
+    it('should let consumers withdraw their earnings in one transfer', async () => {
+        const earned = await getEscrowBalance('user2');
+        assert(earned > 0, 'Expected consumer to have earned something');
+
+        const totemsBefore = getTotemBalance('user2', 'XPAY');
+        await x4o2.actions.withdraw(['user2', '4,XPAY']).send('user2');
+        assert(getTotemBalance('user2', 'XPAY') - totemsBefore === earned, `Expected consumer to have received ${earned} XPAY`);
+        assert(await getEscrowBalance('user2') === 0, 'Expected nothing left to withdraw');
+
+        await expectToThrow(
+            x4o2.actions.withdraw(['user2', '4,XPAY']).send('user2'),
+            "eosio_assert: Nothing to withdraw."
+        );
+    });
+    it('should open balances on deposit and be able to close them', async () => {
+        assert(!(await x4o2.actions.isopen(['user3', '4,XPAY']).send())[0].returnValue, 'Expected user3 to have no balance yet');
+        await totems.actions.transfer(['user3', 'x4o2', '10.0000 XPAY', '']).send('user3');
+        assert(await getEscrowBalance('user3') === 10, 'Expected the deposit to open a balance');
+
+        const quotaUsed = () => Number(JSON.parse(JSON.stringify(x4o2.tables.openquota(nameToBigInt('x4o2')).getTableRows()))[0].used);
+        const usedAfterDeposit = quotaUsed();
+
+        // nothing can be closed while totems are locked, even with nothing spendable left
+        const intent = JSON.parse(JSON.stringify(
+            (await x4o2.actions.authorize(['user3', 'user2', '10.0000 XPAY', HASH, 3600]).send('user3'))[0].returnValue
+        ));
+        assert(await getEscrowBalance('user3') === 0, 'Expected nothing to be spendable');
+        await expectToThrow(
+            x4o2.actions.close(['user3', '4,XPAY']).send('user3'),
+            "eosio_assert: Balance must be zero to close."
+        );
+        await x4o2.actions.revoke([intent.id]).send('user3');
+
+        // a fully settled channel leaves nothing locked, so the balance can be closed before the channel is
+        const channel = JSON.parse(JSON.stringify(
+            (await x4o2.actions.openchannel(['user3', 'user2', '10.0000 XPAY', CHANNEL_KEY.toPublic().toString(), 3600]).send('user3'))[0].returnValue
+        ));
+        await x4o2.actions.settle([channel.id, signVoucher(channel.id, '10.0000 XPAY')]).send('user2');
+        await x4o2.actions.close(['user3', '4,XPAY']).send('user3');
+        assert(!(await x4o2.actions.isopen(['user3', '4,XPAY']).send())[0].returnValue, 'Expected the balance to be closed');
+        assert(quotaUsed() === usedAfterDeposit - 1, 'Expected closing to give the slot back');
+
+        await x4o2.actions.closechannel([channel.id, null]).send('user2');
+        assert(!(await x4o2.actions.getchannel([channel.id]).send())[0].returnValue, 'Expected the channel to be removed');
+    });
 });
+